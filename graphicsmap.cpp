@@ -1,25 +1,65 @@
 ﻿#include "graphicsmap.h"
+#include "tilesource.h"
+#include "sharedtilecache.h"
+#include "maptrace.h"
 #include <QScrollBar>
 #include <QOpenGLWidget>
 #include <QHBoxLayout>
 #include <QResizeEvent>
+#include <QPaintEvent>
 #include <QDebug>
 #include <QGraphicsLineItem>
 #include <QtMath>
 #include <QThread>
-#include <QFileInfo>
 #include <QtMath>
+#include <QRunnable>
+#include <QElapsedTimer>
+#include <QPainter>
+#include <QBuffer>
+#include <QImageReader>
+#include <QCryptographicHash>
+#include <QtEndian>
+#include <limits>
+#include <QMutex>
+#include <QCursor>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 
 #define ZOOM_BASE 10  ///< ZOOM_BASE级瓦片正好缩放为原比例(1:1),低于ZOOM_BASE级的放大，反之缩小
 #define TILE_LEN 256  ///< 瓦片长度，标准的都是256 * 256
 #define SCENE_LEN ((1<<ZOOM_BASE) * TILE_LEN)   ///< 存放瓦片的场景大小
+#define TILE_BYTES (TILE_LEN * TILE_LEN * 4)    ///< 单张RGBA瓦片的内存大小
+#define UPLOAD_INTERVAL 16  ///< 瓦片上传的帧间隔(ms)，约60帧
+#define MOTION_TIMEOUT 500  ///< 视口超过该时间(ms)未移动视为静止
+#define PREFETCH_PRIORITY (1<<26)   ///< 预取瓦片的优先级降低量，保证低于所有可见瓦片
+#define UNWANTED_PRIORITY (std::numeric_limits<int>::min())  ///< 没有订阅者需要的瓦片
+#define WARMUP_PRIORITY (-(1<<30))  ///< 预热瓦片的读取优先级，低于所有显示和预取的瓦片
+#define WARMUP_CONCURRENCY 8        ///< 每个地图同时读取的预热瓦片数量
+#define WARMUP_REPORT_INTERVAL 100  ///< 预热进度的报告间隔(ms)
+#define FETCH_RETRY_INTERVAL 2000   ///< 读取失败的瓦片重新读取的间隔(ms)
+#define FRAME_SAMPLES 240           ///< 参与帧耗时统计的最近帧数
+#define STATS_OVERLAY_INTERVAL 500  ///< 未设置统计间隔时叠加层的刷新间隔(ms)
+#define RENDER_STRIP_HEIGHT 1024    ///< renderImage每条的高度(像素)
+#define RENDER_FALLBACK_LEVELS 4    ///< 离屏渲染时缺失瓦片向上查找代替瓦片的最大层数
 
 QStringList GraphicsMap::m_mapTypes;    ///< 地图资源类型
 
 GraphicsMap::GraphicsMap(QWidget *parent) : QGraphicsView(parent),
     m_type(0),
+    m_bTMS(false),
+    m_frameInterval(0),
+    m_frameIndex(0),
+    m_itemsPainted(0),
+    m_tilesPainted(0),
+    m_statsInterval(0),
+    m_statsOverlay(false),
+    m_uploadBudget(4),
     m_isloading(false),
     m_hasPendingLoad(false),
+    m_lastZoom(0),
+    m_zoomVelocity(0),
+    m_prefetchTime(300),
     m_zoom(1),
     m_minZoom(1),
     m_maxZoom(20),
@@ -28,45 +68,63 @@ GraphicsMap::GraphicsMap(QWidget *parent) : QGraphicsView(parent),
     this->setScene(new QGraphicsScene);
     qRegisterMetaType<GraphicsMap::TileSpec>("GraphicsMap::TileSpec");
     qRegisterMetaType<GraphicsMap::TileRegion>("GraphicsMap::TileRegion");
+    qRegisterMetaType<GraphicsMap::TileDelta>("GraphicsMap::TileDelta");
+    qRegisterMetaType<GraphicsMap::MapStats>("GraphicsMap::MapStats");
     viewport()->setObjectName("GraphicsMap");
 
     init();
     //
     this->scene()->setSceneRect(-SCENE_LEN/2, -SCENE_LEN/2, SCENE_LEN, SCENE_LEN);
+    m_motionTimer.start();
     setZoomLevel(2);
 }
 
 GraphicsMap::~GraphicsMap()
 {
-    // 在此处从场景移出瓦片，防止和多线程析构冲突
-    for(auto item : m_tiles) {
-        this->scene()->removeItem(item);
-    }
+    m_mapThread->unsubscribe(this);
     delete scene();
-    delete m_mapThread;
 }
 
+/// \details 限制帧率时视图自身不再重绘，场景变化(图元、瓦片)和平移的区域累积起来，
+/// 每帧只重绘这些区域；场景空闲时不启动定时器，也就没有空转的重绘
 void GraphicsMap::setFrameRate(int fps)
 {
     if(fps <= 0) {
+        m_frameInterval = 0;
         this->setViewportUpdateMode(QGraphicsView::SmartViewportUpdate);
-        disconnect(&m_updateTimer, &QTimer::timeout, viewport(), qOverload<>(&QGraphicsView::update));
-        m_updateTimer.stop();
+        disconnect(scene(), &QGraphicsScene::changed, this, &GraphicsMap::onSceneChanged);
+        m_frameTimer.stop();
+        paintFrame();
     }
     else {
+        // above 1000 fps the interval would be 0, which means updating on demand
+        m_frameInterval = qMax(1, 1000/fps);
         this->setViewportUpdateMode(QGraphicsView::NoViewportUpdate);
-        connect(&m_updateTimer, &QTimer::timeout, viewport(), qOverload<>(&QGraphicsView::update), Qt::ConnectionType(Qt::DirectConnection|Qt::UniqueConnection));
-        m_updateTimer.start(1000/fps);
+        connect(scene(), &QGraphicsScene::changed, this, &GraphicsMap::onSceneChanged, Qt::UniqueConnection);
     }
 }
 
 void GraphicsMap::setTilePath(const QString &path)
 {
     m_type = mapType(path);
+    m_mapThread->setTMSMode(m_type, m_bTMS);
     emit pathRequested(path);
     updateTile();
 }
 
+void GraphicsMap::setTileSource(TileSource *source)
+{
+    if(!source)
+        return;
+    QSharedPointer<TileSource> sharedSource(source);
+    auto mapThread = m_mapThread.data();
+    m_type = mapType(source->name());
+    QMetaObject::invokeMethod(mapThread, [mapThread, sharedSource](){
+        mapThread->requestSource(sharedSource);
+    }, Qt::QueuedConnection);
+    updateTile();
+}
+
 void GraphicsMap::setZoomLevel(float zoom)
 {
     auto boundZoom = qBound(m_minZoom, zoom, m_maxZoom);
@@ -111,12 +169,266 @@ void GraphicsMap::setRotation(const qreal &degree)
 
 void GraphicsMap::setTileCacheCount(const int &count)
 {
-    m_mapThread->setTileCacheCount(count);
+    m_mapThread->setTileCacheSize(qint64(count) * TILE_BYTES);
+}
+
+void GraphicsMap::setTileCacheSize(const qint64 &bytes)
+{
+    m_mapThread->setTileCacheSize(bytes);
+}
+
+void GraphicsMap::setTilePinnedZoom(const int &zoom)
+{
+    m_mapThread->setPinnedZoom(zoom);
+}
+
+void GraphicsMap::setTileDataCacheSize(const qint64 &bytes)
+{
+    m_mapThread->setDataCacheSize(bytes);
+}
+
+GraphicsMap::TileCacheStats GraphicsMap::tileCacheStats(TileCacheTier tier) const
+{
+    return m_mapThread->cacheStats(tier);
+}
+
+void GraphicsMap::setTileSharedCache(const QString &key, const qint64 &bytes)
+{
+    m_mapThread->setSharedCache(key, bytes);
+}
+
+/// \details 帧耗时分位数取最近FRAME_SAMPLES帧，缓存命中率由命中和未命中次数计算，均为累计值
+GraphicsMap::MapStats GraphicsMap::stats() const
+{
+    MapStats stats;
+    auto times = m_frameTimes;
+    if(!times.isEmpty()) {
+        std::sort(times.begin(), times.end());
+        auto percentile = [&times](int p) {
+            return qreal(times.at(qMax(0, qCeil(times.size() * p / 100.0) - 1)));
+        };
+        stats.frameP50 = percentile(50);
+        stats.frameP95 = percentile(95);
+        stats.frameP99 = percentile(99);
+    }
+    stats.frames = times.size();
+    stats.itemsPainted = m_itemsPainted;
+    stats.tilesPainted = m_tilesPainted;
+    stats.visibleTiles = m_tiles.size();
+    for(const auto &tile : m_tiles) {
+        if(!tile.pixmap.isNull())
+            stats.pixmapBytes += qint64(tile.pixmap.width()) * tile.pixmap.height() * tile.pixmap.depth() / 8;
+    }
+    stats.pendingUploads = m_uploadImages.size();
+    stats.pendingLoads = m_mapThread->loadingCount();
+    stats.decodeLatency = m_mapThread->decodeLatency();
+    stats.decodedCache = m_mapThread->cacheStats(DecodedTier);
+    stats.compressedCache = m_mapThread->cacheStats(CompressedTier);
+    stats.sharedCache = m_mapThread->cacheStats(SharedTier);
+    return stats;
+}
+
+void GraphicsMap::setStatsInterval(int msec)
+{
+    m_statsInterval = qMax(0, msec);
+    restartStats();
+}
+
+void GraphicsMap::setStatsOverlayVisible(bool visible)
+{
+    if(m_statsOverlay == visible)
+        return;
+    m_statsOverlay = visible;
+    if(!visible) {
+        updateRegion(m_statsRect);
+        m_statsText.clear();
+        m_statsRect = QRect();
+    }
+    restartStats();
+    if(visible)
+        updateStats();
+}
+
+void GraphicsMap::setTileDecodeThreadCount(const int &count)
+{
+    m_mapThread->setDecodeThreadCount(count);
+}
+
+void GraphicsMap::setTileUploadBudget(const int &msec)
+{
+    m_uploadBudget = qMax(1, msec);
+}
+
+void GraphicsMap::setTilePrefetchTime(const int &msec)
+{
+    m_prefetchTime = qMax(0, msec);
 }
 
 void GraphicsMap::setTMSMode(const bool &on)
 {
-    m_mapThread->setTMSMode(on);
+    m_bTMS = on;
+    if(m_type)
+        m_mapThread->setTMSMode(m_type, on);
+}
+
+/// \details 按场景坐标换算各层级的瓦片范围，超出最大缩放层级的瓦片不会显示，不需要预热
+void GraphicsMap::prefetchRegion(const QGeoRectangle &rect, int minZoom, int maxZoom)
+{
+    if(!rect.isValid())
+        return;
+    const auto topLeft = toScene(rect.topLeft());
+    const auto bottomRight = toScene(rect.bottomRight());
+    QVector<QPair<quint8, QRect>> levels;
+    for(auto zoom = qMax(0, minZoom); zoom <= qMin(maxZoom, int(m_maxZoom)); ++zoom) {
+        const qint32 tileCount = 1 << zoom;
+        auto toTile = [tileCount](qreal pos) {
+            return qBound<qint32>(0, (pos+SCENE_LEN/2) / SCENE_LEN * tileCount, tileCount-1);
+        };
+        levels.append(qMakePair(quint8(zoom), QRect(QPoint(toTile(topLeft.x()), toTile(topLeft.y())),
+                                                    QPoint(toTile(bottomRight.x()), toTile(bottomRight.y())))));
+    }
+    auto mapThread = m_mapThread.data();
+    auto type = m_type;
+    QMetaObject::invokeMethod(mapThread, [mapThread, map = this, type, levels](){
+        mapThread->warmupRegion(map, type, levels);
+    }, Qt::QueuedConnection);
+}
+
+void GraphicsMap::cancelPrefetch()
+{
+    auto mapThread = m_mapThread.data();
+    QMetaObject::invokeMethod(mapThread, [mapThread, map = this](){
+        mapThread->cancelWarmup(map);
+    }, Qt::QueuedConnection);
+}
+
+QImage GraphicsMap::renderImage(const QGeoRectangle &rect, float zoom, qreal rotation)
+{
+    QSize size;
+    renderBox(rect, zoom, size);
+    if(size.isEmpty())
+        return QImage();
+    QImage image(size, QImage::Format_ARGB32_Premultiplied);
+    // too large for a single image, it has to be rendered in strips
+    if(image.isNull())
+        return QImage();
+    QPainter painter(&image);
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    const bool completed = renderStrips(rect, zoom, rotation, RENDER_STRIP_HEIGHT, [&painter](const QImage &strip, int y){
+        painter.drawImage(0, y, strip);
+        return true;
+    });
+    painter.end();
+    return completed ? image : QImage();
+}
+
+/// 在线程池中并行读取并解码瓦片，不存在的瓦片为空图片
+/// \note 整次渲染共用一个线程池，网络数据源的线程及其连接得以复用
+static QVector<QImage> readTiles(QThreadPool &pool, TileSource *source, const QVector<GraphicsMap::TileSpec> &specs)
+{
+    QVector<QImage> images(specs.size());
+    // each task writes its own element, the vector must not detach meanwhile
+    auto output = images.data();
+    for(int i = 0; i < specs.size(); ++i) {
+        const auto tileSpec = specs.at(i);
+        pool.start(new FunctionTask([source, tileSpec, output, i](){
+            if(source->availability(tileSpec) == TileSource::Unavailable)
+                return;
+            const auto data = source->read(tileSpec);
+            if(!data.isEmpty())
+                output[i] = QImage::fromData(data);
+        }));
+    }
+    pool.waitForDone();
+    return images;
+}
+
+/// \details 逐条计算其覆盖的场景范围，读取该范围内的瓦片，缺失的瓦片逐层向上读取代替瓦片，
+/// 与drawBackground相同按层级从低到高绘制，再绘制场景图元。跨越相邻两条的瓦片只读取一次
+bool GraphicsMap::renderStrips(const QGeoRectangle &rect, float zoom, qreal rotation, int stripHeight,
+                               const std::function<bool(const QImage &strip, int y)> &sink)
+{
+    QSize size;
+    const auto box = renderBox(rect, zoom, size);
+    if(size.isEmpty() || stripHeight <= 0)
+        return false;
+    const auto source = m_mapThread->tileSource(m_type);
+    const qreal scale = qPow(2, zoom - ZOOM_BASE);
+    QTransform transform;
+    transform.translate(size.width() / 2.0, size.height() / 2.0);
+    transform.scale(scale, scale);
+    transform.rotate(-rotation);
+    transform.translate(-box.center().x(), -box.center().y());
+    const auto inverted = transform.inverted();
+    // overzoomed levels are drawn from the tiles of max zoom
+    int level = qFloor(zoom + 0.5);
+    if(source && source->maxZoom() >= 0)
+        level = qMin(level, source->maxZoom());
+    QThreadPool pool;
+    pool.setMaxThreadCount(QThread::idealThreadCount());
+    QMap<TileSpec, QImage> loaded;
+    for(int y = 0; y < size.height(); y += stripHeight) {
+        const QRect stripRect(0, y, size.width(), qMin(stripHeight, size.height() - y));
+        const auto sceneRect = inverted.mapRect(QRectF(stripRect));
+        QMap<TileSpec, QImage> tiles;
+        if(source) {
+            const qint32 tileCount = 1 << level;
+            auto toTile = [tileCount](qreal pos) {
+                return qBound<qint32>(0, (pos+SCENE_LEN/2) / SCENE_LEN * tileCount, tileCount-1);
+            };
+            QVector<TileSpec> wanted;
+            for(auto row = toTile(sceneRect.top()); row <= toTile(sceneRect.bottom()); ++row) {
+                for(auto col = toTile(sceneRect.left()); col <= toTile(sceneRect.right()); ++col) {
+                    wanted.append(TileSpec{m_type, quint8(level), quint32(col), quint32(row)});
+                }
+            }
+            for(int z = level; z >= qMax(0, level - RENDER_FALLBACK_LEVELS) && !wanted.isEmpty(); --z) {
+                QVector<TileSpec> toRead;
+                for(const auto &tileSpec : wanted) {
+                    auto iter = loaded.constFind(tileSpec);
+                    if(iter != loaded.constEnd())
+                        tiles.insert(tileSpec, iter.value());
+                    else
+                        toRead.append(tileSpec);
+                }
+                const auto images = readTiles(pool, source.data(), toRead);
+                for(int i = 0; i < toRead.size(); ++i) {
+                    tiles.insert(toRead.at(i), images.at(i));
+                }
+                QSet<TileSpec> parents;
+                for(const auto &tileSpec : wanted) {
+                    if(z > 0 && tiles.value(tileSpec).isNull())
+                        parents.insert(tileSpec.rise());
+                }
+                // QSet::toList is deprecated and the range constructor of QVector needs Qt 5.14
+                wanted.clear();
+                wanted.reserve(parents.size());
+                for(const auto &parent : parents) {
+                    wanted.append(parent);
+                }
+            }
+        }
+        // only the tiles of this strip are kept for the next one
+        loaded = tiles;
+        //
+        QImage strip(stripRect.size(), QImage::Format_ARGB32_Premultiplied);
+        strip.fill(Qt::transparent);
+        QPainter painter(&strip);
+        painter.setRenderHints(renderHints() | QPainter::SmoothPixmapTransform);
+        painter.translate(0, -y);
+        painter.setTransform(transform, true);
+        if(backgroundBrush().style() != Qt::NoBrush)
+            painter.fillRect(sceneRect, backgroundBrush());
+        for(auto iter = tiles.cbegin(); iter != tiles.cend(); ++iter) {
+            if(!iter.value().isNull())
+                painter.drawImage(tileRect(iter.key()), iter.value());
+        }
+        scene()->render(&painter, sceneRect, sceneRect, Qt::IgnoreAspectRatio);
+        painter.end();
+        if(!sink(strip, y))
+            return false;
+    }
+    return true;
 }
 
 void GraphicsMap::centerOn(const QGeoCoordinate &coord)
@@ -163,6 +475,8 @@ QPointF GraphicsMap::toScene(const QGeoCoordinate &coord)
 /// 从1编号
 quint8 GraphicsMap::mapType(const QString &path)
 {
+    static QMutex mutex;
+    QMutexLocker locker(&mutex);
     if(!m_mapTypes.contains(path))
         m_mapTypes.append(path);
     return m_mapTypes.indexOf(path)+1;
@@ -189,28 +503,56 @@ void GraphicsMap::resizeEvent(QResizeEvent *event)
     QGraphicsView::resizeEvent(event);
 }
 
+void GraphicsMap::scrollContentsBy(int dx, int dy)
+{
+    QGraphicsView::scrollContentsBy(dx, dy);
+    // the view doesn't scroll the viewport itself without viewport updates
+    if(m_frameInterval > 0)
+        scheduleFrame(viewport()->rect());
+    // the scrolled pixels carry a copy of the overlay, which stays at its place
+    else if(!m_statsText.isEmpty()) {
+        viewport()->update(m_statsRect);
+        viewport()->update(m_statsRect.translated(dx, dy));
+    }
+}
+
+/// \note 图元数量需要查询场景索引，只在启用统计时计算，且不计入帧耗时
+void GraphicsMap::paintEvent(QPaintEvent *event)
+{
+    m_tilesPainted = 0;
+    if(m_statsTimer.isActive())
+        m_itemsPainted = items(event->region().boundingRect()).size();
+    QElapsedTimer timer;
+    timer.start();
+    {
+        MAP_TRACE_SCOPE("paint");
+        QGraphicsView::paintEvent(event);
+    }
+    const float msec = timer.nsecsElapsed() / 1e6;
+    if(m_frameTimes.size() < FRAME_SAMPLES)
+        m_frameTimes.append(msec);
+    else
+        m_frameTimes[m_frameIndex] = msec;
+    m_frameIndex = (m_frameIndex + 1) % FRAME_SAMPLES;
+}
+
 void GraphicsMap::init()
 {
-    m_mapThread = new GraphicsMapThread;
+    m_frameTimer.setSingleShot(true);
+    connect(&m_frameTimer, &QTimer::timeout, this, &GraphicsMap::paintFrame);
+    m_frameClock.start();
+    connect(&m_statsTimer, &QTimer::timeout, this, &GraphicsMap::updateStats);
+    // all maps in the process share one tile thread, each subscribes to its own regions
+    m_mapThread = GraphicsMapThread::instance();
+    m_mapThread->subscribe(this);
+    auto mapThread = m_mapThread.data();
     // connect those necessary slot for map tile loading
-    connect(this, &GraphicsMap::tileRequested, m_mapThread, &GraphicsMapThread::requestTile, Qt::QueuedConnection);
-    connect(this, &GraphicsMap::pathRequested, m_mapThread, &GraphicsMapThread::requestPath, Qt::QueuedConnection);
-    //
-    connect(m_mapThread, &GraphicsMapThread::tileToAdd, this, [&](QGraphicsItem* item){
-        this->scene()->addItem(item);
-        m_tiles.insert(item);
-    }, Qt::QueuedConnection);
-    connect(m_mapThread, &GraphicsMapThread::tileToRemove, this, [&](QGraphicsItem* item){
-        this->scene()->removeItem(item);
-        m_tiles.remove(item);
-    }, Qt::QueuedConnection);
-    connect(m_mapThread, &GraphicsMapThread::requestFinished, this, [&](){
-        m_isloading = false;
-        if(m_hasPendingLoad) {
-            updateTile();
-            m_hasPendingLoad = false;
-        }
+    connect(this, &GraphicsMap::tileRequested, mapThread, [this, mapThread](const TileRegion &region){
+        mapThread->requestTile(this, region);
     }, Qt::QueuedConnection);
+    connect(this, &GraphicsMap::pathRequested, mapThread, &GraphicsMapThread::requestPath, Qt::QueuedConnection);
+    //
+    connect(&m_uploadTimer, &QTimer::timeout, this, &GraphicsMap::uploadTile);
     // TODO: We have to use Qt::QueuedConnection, if not, we will see the map twinkle when scale
     connect(this->horizontalScrollBar(), &QScrollBar::valueChanged, this, [&](){
         if(m_isloading)
@@ -228,6 +570,7 @@ void GraphicsMap::init()
 
 void GraphicsMap::updateTile()
 {
+    MAP_TRACE_SCOPE("updateTile");
     quint8 intZoom = qFloor(m_zoom+0.5);
     //
     qint32 tileCount = qPow(2, intZoom);
@@ -244,23 +587,412 @@ void GraphicsMap::updateTile()
     auto verCount = QVector2D(xOrigin, yOrigin).distanceToPoint(QVector2D(xVer, yVer));
     TileSpec origin{m_type, intZoom, static_cast<quint32>(xOrigin), static_cast<quint32>(yOrigin)};
     TileRegion region{origin, m_rotation, static_cast<quint8>(horCount+2), static_cast<quint8>(verCount+2)};
+    // tiles shown smaller than their own size are decoded smaller, counted in device pixels on HiDPI screens
+    region.tileSize = qBound(32, qCeil(TILE_LEN * qPow(2, m_zoom - intZoom) * viewport()->devicePixelRatioF() / 32) * 32, TILE_LEN);
+    updatePrefetch(region);
     //
     if(m_tileRegion == region || xOrigin < 0 || xOrigin >= tileCount)
         return;
+    // tiles around the cursor are wanted first when zooming under mouse
+    auto focusPoint = viewport()->rect().center();
+    if(transformationAnchor() == QGraphicsView::AnchorUnderMouse && viewport()->underMouse())
+        focusPoint = viewport()->mapFromGlobal(QCursor::pos());
+    auto focusPos = mapToScene(focusPoint);
     m_tileRegion = region;
+    m_tileRegion.focus = QPointF((focusPos.x()+SCENE_LEN/2) / SCENE_LEN * tileCount, (focusPos.y()+SCENE_LEN/2) / SCENE_LEN * tileCount);
     m_isloading = true;
     emit tileRequested(m_tileRegion);
 }
 
+void GraphicsMap::finishTileRequest()
+{
+    m_isloading = false;
+    if(m_hasPendingLoad) {
+        updateTile();
+        m_hasPendingLoad = false;
+    }
+}
+
+/// \details 视口中心和层级的变化速度做指数平滑，按预取时间外推得到视口将要到达的区域，
+/// 放大时预取下一层级，缩小时预取上一层级
+void GraphicsMap::updatePrefetch(TileRegion &region)
+{
+    auto viewRect = mapToScene(viewport()->rect()).boundingRect();
+    auto center = viewRect.center();
+    auto elapsed = m_motionTimer.elapsed();
+    if(elapsed >= MOTION_TIMEOUT) {
+        m_panVelocity = QPointF();
+        m_zoomVelocity = 0;
+    }
+    else if(elapsed > 0) {
+        m_panVelocity = m_panVelocity * 0.5 + (center - m_lastCenter) / elapsed * 0.5;
+        m_zoomVelocity = m_zoomVelocity * 0.5 + (m_zoom - m_lastZoom) / elapsed * 0.5;
+    }
+    // samples within the same millisecond are merged into the next one
+    if(elapsed > 0) {
+        m_lastCenter = center;
+        m_lastZoom = m_zoom;
+        m_motionTimer.restart();
+    }
+    //
+    auto offset = m_panVelocity * m_prefetchTime;
+    auto zoomOffset = m_zoomVelocity * m_prefetchTime;
+    // less than a tenth of the viewport or a tenth of level is not worth to prefetch
+    if(m_prefetchTime <= 0 || (qAbs(offset.x()) < viewRect.width()/10 && qAbs(offset.y()) < viewRect.height()/10 && qAbs(zoomOffset) < 0.1))
+        return;
+    auto zoom = qBound(m_minZoom, float(m_zoom + zoomOffset), m_maxZoom);
+    quint8 prefetchZoom = qFloor(zoom + 0.5);
+    // the viewport is scaled around its center when zooming
+    auto scale = qPow(2, m_zoom - zoom);
+    QRectF predictRect(0, 0, viewRect.width() * scale, viewRect.height() * scale);
+    predictRect.moveCenter(center + offset);
+    // scene coordinate to tile coordinate of prefetch zoom
+    qint32 tileCount = qPow(2, prefetchZoom);
+    auto toTile = [tileCount](qreal pos) {
+        return qBound<qint32>(0, (pos+SCENE_LEN/2) / SCENE_LEN * tileCount, tileCount-1);
+    };
+    region.prefetchZoom = prefetchZoom;
+    region.prefetchRect = QRect(QPoint(toTile(predictRect.left()), toTile(predictRect.top())),
+                                QPoint(toTile(predictRect.right()), toTile(predictRect.bottom())));
+}
+
+/// \note 解码好的图片只在这里排队，QPixmap由uploadTile在每帧的时间预算内创建
+void GraphicsMap::applyTileDelta(const TileDelta &delta)
+{
+    MAP_TRACE_SCOPE("applyTileDelta");
+    QSet<TileSpec> replaced;
+    for(const auto &tile : delta.added) {
+        replaced.insert(tile.first);
+    }
+    for(const auto &tileSpec : delta.removed) {
+        // a tile replaced by a larger variant is kept on screen until the new one is uploaded
+        if(replaced.contains(tileSpec))
+            continue;
+        // a pending upload is dropped, and an older variant already on screen goes as well
+        m_uploadImages.remove(tileSpec);
+        if(m_tiles.remove(tileSpec))
+            invalidateScene(tileRect(tileSpec), QGraphicsScene::BackgroundLayer);
+    }
+    for(const auto &tile : delta.added) {
+        m_uploadQueue.enqueue(tile.first);
+        m_uploadImages.insert(tile.first, tile.second);
+    }
+    if(!m_uploadQueue.isEmpty() && !m_uploadTimer.isActive())
+        m_uploadTimer.start(0);
+}
+
+void GraphicsMap::uploadTile()
+{
+    MAP_TRACE_SCOPE("uploadTile");
+    QElapsedTimer elapsedTimer;
+    elapsedTimer.start();
+    const qint64 budget = qint64(m_uploadBudget) * 1000000;
+    while (!m_uploadQueue.isEmpty() && elapsedTimer.nsecsElapsed() < budget) {
+        auto tileSpec = m_uploadQueue.dequeue();
+        auto image = m_uploadImages.take(tileSpec);
+        // it has been removed before uploading
+        if(image.isNull())
+            continue;
+        TilePixmap tile;
+        // solid colour tiles are filled, no pixmap is created for them
+        if(GraphicsMapThread::isFill(image))
+            tile.color = image.pixelColor(0, 0);
+        else
+            tile.pixmap = QPixmap::fromImage(image);
+        m_tiles.insert(tileSpec, tile);
+        invalidateScene(tileRect(tileSpec), QGraphicsScene::BackgroundLayer);
+    }
+    // continue at next frame
+    if(m_uploadQueue.isEmpty())
+        m_uploadTimer.stop();
+    else
+        m_uploadTimer.start(UPLOAD_INTERVAL);
+}
+
+void GraphicsMap::onSceneChanged(const QList<QRectF> &region)
+{
+    QRegion dirty;
+    for(const auto &rect : region) {
+        // a margin for antialiased edges, the same as the view does itself
+        dirty += mapFromScene(rect).boundingRect().adjusted(-2, -2, 2, 2) & viewport()->rect();
+    }
+    scheduleFrame(dirty);
+}
+
+void GraphicsMap::scheduleFrame(const QRegion &region)
+{
+    if(region.isEmpty())
+        return;
+    m_dirtyRegion += region;
+    if(!m_frameTimer.isActive())
+        m_frameTimer.start(qMax<qint64>(0, m_frameInterval - m_frameClock.elapsed()));
+}
+
+void GraphicsMap::paintFrame()
+{
+    if(m_dirtyRegion.isEmpty())
+        return;
+    m_frameClock.restart();
+    viewport()->update(m_dirtyRegion);
+    m_dirtyRegion = QRegion();
+}
+
+void GraphicsMap::updateRegion(const QRegion &region)
+{
+    if(m_frameInterval > 0)
+        scheduleFrame(region);
+    else
+        viewport()->update(region);
+}
+
+void GraphicsMap::restartStats()
+{
+    if(m_statsInterval > 0)
+        m_statsTimer.start(m_statsInterval);
+    else if(m_statsOverlay)
+        m_statsTimer.start(STATS_OVERLAY_INTERVAL);
+    else
+        m_statsTimer.stop();
+}
+
+void GraphicsMap::updateStats()
+{
+    const auto stats = this->stats();
+    if(m_statsOverlay) {
+        auto cacheLine = [](const QString &name, const TileCacheStats &cache) {
+            const auto lookups = cache.hits + cache.misses;
+            return QString("%1 %2 / %3 MB  hit %4%")
+                    .arg(name)
+                    .arg(cache.bytes >> 20)
+                    .arg(cache.maxBytes >> 20)
+                    .arg(lookups ? cache.hits * 100 / lookups : 0);
+        };
+        QStringList lines;
+        lines << QString("frame p50/p95/p99 %1 / %2 / %3 ms")
+                 .arg(stats.frameP50, 0, 'f', 1)
+                 .arg(stats.frameP95, 0, 'f', 1)
+                 .arg(stats.frameP99, 0, 'f', 1);
+        lines << QString("items %1  tiles %2 / %3  pixmaps %4 MB")
+                 .arg(stats.itemsPainted)
+                 .arg(stats.tilesPainted)
+                 .arg(stats.visibleTiles)
+                 .arg(stats.pixmapBytes >> 20);
+        lines << QString("upload %1  loading %2  decode %3 ms")
+                 .arg(stats.pendingUploads)
+                 .arg(stats.pendingLoads)
+                 .arg(stats.decodeLatency / 1000.0, 0, 'f', 1);
+        lines << cacheLine("decoded", stats.decodedCache);
+        lines << cacheLine("compressed", stats.compressedCache);
+        if(stats.sharedCache.maxBytes > 0)
+            lines << cacheLine("shared", stats.sharedCache);
+        // the old area is repainted as well, the text may have shrunk
+        const QRegion dirty(m_statsRect);
+        m_statsText = lines.join('\n');
+        m_statsRect = viewport()->fontMetrics().boundingRect(QRect(0, 0, 10000, 10000), Qt::AlignLeft | Qt::AlignTop, m_statsText)
+                .adjusted(-6, -4, 6, 4).translated(12, 10);
+        updateRegion(dirty + m_statsRect);
+    }
+    if(m_statsInterval > 0)
+        emit statsUpdated(stats);
+}
+
+QRectF GraphicsMap::renderBox(const QGeoRectangle &rect, float zoom, QSize &size)
+{
+    size = QSize();
+    if(!rect.isValid())
+        return QRectF();
+    const auto box = QRectF(toScene(rect.topLeft()), toScene(rect.bottomRight())).normalized();
+    const qreal scale = qPow(2, zoom - ZOOM_BASE);
+    size = QSize(qCeil(box.width() * scale), qCeil(box.height() * scale));
+    return box;
+}
+
+/*!
+ * \brief GraphicsMap::tileRect 瓦片在场景中的矩形
+ * \note 可以理解成将瓦片按照原始大小排列在矩形中(比如1层有四张瓦片，那么排列在256*4->256*4的矩形中)，
+ * 然后这个矩形从右下角整个向左上角缩放达到和sceneRect()正好重合，以实现所有不同zoom的瓦片都重叠在sceneRect()上，也达到了缺省瓦片通过上层瓦片显示的效果。
+ * 为了方便经纬度和场景坐标的转换，这里将经纬度（0，0）映射在了场景坐标的（0，0）处，所以注意xOff和yOff是先移动到以（0，0）为原点的位置，再向左上移动半个场景的宽度和高度
+ */
+QRectF GraphicsMap::tileRect(const TileSpec &tileSpec)
+{
+    int tileCount = qPow(2, tileSpec.zoom);
+    double scaleFac = 1.0 / qPow(2, (tileSpec.zoom-ZOOM_BASE));
+    double xOff = TILE_LEN * (tileSpec.x  - tileCount/2.0);     // see also: TILE_LEN * tileSpec.x - (TILE_LEN*tileCount) / 2;
+    double yOff = TILE_LEN * (tileSpec.y  - tileCount/2.0);     // see also: TILE_LEN * tileSpec.y - (TILE_LEN*tileCount) / 2;
+    return QRectF(xOff * scaleFac, yOff * scaleFac, TILE_LEN * scaleFac, TILE_LEN * scaleFac);
+}
+
+/// \details 瓦片不再作为场景图元，不参与场景索引、碰撞检测和Z值排序，
+/// 在背景层中按层级从低到高绘制，缺省的瓦片自然由上层瓦片代替显示
+void GraphicsMap::drawBackground(QPainter *painter, const QRectF &rect)
+{
+    QGraphicsView::drawBackground(painter, rect);
+    for(auto iter = m_tiles.cbegin(); iter != m_tiles.cend(); ++iter) {
+        auto targetRect = tileRect(iter.key());
+        if(!targetRect.intersects(rect))
+            continue;
+        if(iter.value().pixmap.isNull())
+            painter->fillRect(targetRect, iter.value().color);
+        else
+            painter->drawPixmap(targetRect, iter.value().pixmap, iter.value().pixmap.rect());
+        ++m_tilesPainted;
+    }
+}
+
+/// 统计叠加层按视口坐标绘制，不随地图缩放和旋转
+void GraphicsMap::drawForeground(QPainter *painter, const QRectF &rect)
+{
+    QGraphicsView::drawForeground(painter, rect);
+    if(m_statsText.isEmpty())
+        return;
+    painter->save();
+    painter->resetTransform();
+    painter->setFont(viewport()->font());
+    painter->setPen(Qt::NoPen);
+    painter->setBrush(QColor(0, 0, 0, 160));
+    painter->drawRect(m_statsRect);
+    painter->setPen(Qt::white);
+    painter->drawText(m_statsRect.adjusted(6, 4, -6, -4), Qt::AlignLeft | Qt::AlignTop, m_statsText);
+    painter->restore();
+}
+
+/// 是否所有像素都相同，按像素字节比较，调色板图片比较索引
+static bool isSolidImage(const QImage &image)
+{
+    if(image.isNull() || image.depth() < 8)
+        return false;
+    const int pixelBytes = image.depth() / 8;
+    const int lineBytes = image.width() * pixelBytes;
+    const uchar *first = image.constScanLine(0);
+    for(int x = 1; x < image.width(); ++x) {
+        if(memcmp(first, first + x * pixelBytes, size_t(pixelBytes)) != 0)
+            return false;
+    }
+    for(int y = 1; y < image.height(); ++y) {
+        if(memcmp(first, image.constScanLine(y), size_t(lineBytes)) != 0)
+            return false;
+    }
+    return true;
+}
+
+/// 压缩数据的64位摘要，取SHA1的前8字节(与TileArchive::pack去重相同)，0保留给未计算摘要的瓦片
+static quint64 tileDigest(const QByteArray &data)
+{
+    const auto hash = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+    const auto digest = qFromBigEndian<quint64>(reinterpret_cast<const uchar*>(hash.constData()));
+    return digest ? digest : 1;
+}
+
+/// 进程间共享缓存中数据源的名称，TMS协议下同一瓦片编号对应另一张瓦片，所以按协议区分
+static QString sharedCacheName(const TileSource *source)
+{
+    return source->isTMSMode() ? source->name() + QStringLiteral("#tms") : source->name();
+}
+
+/// 瓦片解码任务，解码完成后回到瓦片线程放入缓存
+/// 也用于超出最大层级时，从上层瓦片截取对应部分放大生成瓦片
+/// \note 任务由瓦片线程负责删除，以便在开始执行前通过QThreadPool::tryTake取消
+class GraphicsMapThread::TileDecodeTask : public QRunnable
+{
+public:
+    /// 按尺寸解码 \param size 解码尺寸，小于瓦片原始大小时缩小解码(jpg可直接按DCT缩放解码)
+    TileDecodeTask(GraphicsMapThread *mapThread, const GraphicsMap::TileSpec &tileSpec, const QByteArray &data, int size) :
+        m_mapThread(mapThread),
+        m_tileSpec(tileSpec),
+        m_data(data),
+        m_size(size)
+    {
+        setAutoDelete(false);
+    }
+    /// 截取上层瓦片的rect部分放大到size
+    TileDecodeTask(GraphicsMapThread *mapThread, const GraphicsMap::TileSpec &tileSpec, const QImage &parent, const QRect &rect, int size) :
+        m_mapThread(mapThread),
+        m_tileSpec(tileSpec),
+        m_parent(parent),
+        m_rect(rect),
+        m_size(size)
+    {
+        setAutoDelete(false);
+    }
+    /// 解码完成后放入跨进程共享缓存
+    void setSharedCache(const QSharedPointer<SharedTileCache> &sharedCache, const QString &source)
+    {
+        m_sharedCache = sharedCache;
+        m_source = source;
+    }
+    void run() override
+    {
+        MAP_TRACE_SCOPE("tileDecode");
+        QElapsedTimer timer;
+        timer.start();
+        QImage image;
+        if(!m_parent.isNull()) {
+            image = m_parent.copy(m_rect).scaled(m_size, m_size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        }
+        else {
+            QBuffer buffer(&m_data);
+            QImageReader reader(&buffer);
+            const auto size = reader.size();
+            if(size.isValid() && m_size > 0 && m_size < size.width())
+                reader.setScaledSize(size * m_size / size.width());
+            image = reader.read();
+        }
+        // solid colour tiles (sea, empty land) keep only the fill colour
+        if(isSolidImage(image)) {
+            QImage fill(1, 1, QImage::Format_ARGB32);
+            fill.setPixelColor(0, 0, image.pixelColor(0, 0));
+            image = fill;
+        }
+        m_mapThread->reportDecodeLatency(timer.nsecsElapsed() / 1000);
+        // publish it for the other processes off the tile thread
+        if(m_sharedCache && !image.isNull())
+            m_sharedCache->insert(m_source, m_tileSpec.zoom, m_tileSpec.x, m_tileSpec.y, image);
+        auto mapThread = m_mapThread;
+        auto tileSpec = m_tileSpec;
+        auto task = this;
+        QMetaObject::invokeMethod(mapThread, [mapThread, tileSpec, image, task](){
+            mapThread->onTileDecoded(tileSpec, image, task);
+        }, Qt::QueuedConnection);
+    }
+
+private:
+    GraphicsMapThread    *m_mapThread;
+    GraphicsMap::TileSpec m_tileSpec;
+    QByteArray            m_data;
+    QImage                m_parent;
+    QRect                 m_rect;
+    int                   m_size;
+    QSharedPointer<SharedTileCache> m_sharedCache;
+    QString               m_source;
+};
+
 GraphicsMapThread::TileCacheNode::~TileCacheNode()
 {
-    delete value;
+    if(usage)
+        usage->fetchAndSubRelaxed(bytes);
 }
 
 GraphicsMapThread::GraphicsMapThread():
-    m_bTMS(false)
+    m_tileCacheCost(0),
+    m_cacheMaxBytes(qint64(1000) * TILE_BYTES),
+    m_pinnedBytes(0),
+    m_pinnedZoom(3),
+    m_cacheBytes(0),
+    m_cachePeakBytes(0),
+    m_cacheHits(0),
+    m_cacheMisses(0),
+    m_dataCacheMaxBytes(qint64(64) * 1024 * 1024),
+    m_dataCacheBytes(0),
+    m_dataCachePeakBytes(0),
+    m_dataCacheHits(0),
+    m_dataCacheMisses(0),
+    m_generation(0),
+    m_refreshPending(false),
+    m_loadingCount(0),
+    m_decodeLatency(0)
 {
-    m_tileCache.setMaxCost(1000);
+    updateCacheCost();
+    m_decodePool.setMaxThreadCount(QThread::idealThreadCount());
     //
     QThread *thread = new QThread;
     thread->setObjectName("MapThread");
@@ -272,171 +1004,1212 @@ GraphicsMapThread::~GraphicsMapThread()
 {
     this->thread()->quit();
     this->thread()->wait();
+    m_decodePool.clear();
+    m_decodePool.waitForDone();
+    for(const auto &load : m_tileLoading) {
+        delete load.decodeTask;
+    }
+    // sources stop their I/O threads when destroyed
+    m_sources.clear();
+    qDeleteAll(m_subscribers);
+    qDeleteAll(m_pinnedCache);
+    m_tileCache.forEach([](quint64, TileCacheNode *node){
+        delete node;
+    });
+    m_tileCache.clear();
     delete this->thread();
 }
 
-void GraphicsMapThread::requestTile(const GraphicsMap::TileRegion &region)
+/// \note 只在GUI线程中调用，所以无需加锁
+QSharedPointer<GraphicsMapThread> GraphicsMapThread::instance()
+{
+    static QWeakPointer<GraphicsMapThread> shared;
+    auto mapThread = shared.toStrongRef();
+    if(!mapThread) {
+        mapThread.reset(new GraphicsMapThread);
+        shared = mapThread;
+    }
+    return mapThread;
+}
+
+void GraphicsMapThread::subscribe(GraphicsMap *map)
+{
+    QMetaObject::invokeMethod(this, [this, map](){
+        auto subscriber = new TileSubscriber;
+        subscriber->map = map;
+        m_subscribers.insert(map, subscriber);
+    });
+}
+
+/// \note 地图析构时调用，阻塞等待瓦片线程移除订阅者，之后不会再有发往该地图的调用
+void GraphicsMapThread::unsubscribe(GraphicsMap *map)
+{
+    QMetaObject::invokeMethod(this, [this, map](){
+        auto sub = m_subscribers.take(map);
+        if(sub)
+            dropWarmup(*sub);
+        delete sub;
+        // loads wanted by the map only are canceled
+        updateLoading();
+    }, Qt::BlockingQueuedConnection);
+}
+
+/// \note 排在之前请求的数据源之后执行，setTilePath后立即调用也能取到新的数据源
+QSharedPointer<TileSource> GraphicsMapThread::tileSource(quint8 type)
+{
+    QSharedPointer<TileSource> source;
+    QMetaObject::invokeMethod(this, [this, type, &source](){
+        source = m_sources.value(type);
+    }, Qt::BlockingQueuedConnection);
+    return source;
+}
+
+void GraphicsMapThread::requestTile(GraphicsMap *map, const GraphicsMap::TileRegion &region)
 {
+    MAP_TRACE_SCOPE("requestTile");
+    auto subscriber = m_subscribers.value(map);
+    if(!subscriber)
+        return;
+    auto &sub = *subscriber;
     // hide all tile items if tile resource path is invalid
-    if(m_path.isEmpty()) {
-        for(auto &tile : m_tileShowedSet) {
-            hideItem(tile);
+    if(!m_sources.value(region.origin.type)) {
+        const auto showedSet = sub.tileShowedSet;
+        for(auto &tile : showedSet) {
+            hideItem(sub, tile);
         }
-        emit requestFinished();
+        flushDelta(sub);
+        sub.tileView = TileView();
+        sub.tilePrefetchSet.clear();
+        sub.tileRefs.clear();
+        sub.tileToFetch.clear();
+        sub.tileRegion = region;
+        finishRequest(sub);
         return;
     }
     // just ignore the requeset if rect arec not changed
-    if(m_tileRegion == region) {
-        emit requestFinished();
+    if(sub.tileRegion == region) {
+        finishRequest(sub);
         return;
     }
 
     //
-    m_tileRegion = region;
+    const auto oldTileSize = sub.tileRegion.tileSize;
+    sub.tileRegion = region;
+    ++m_generation;
 
-    // methoad： 将矩形区域视作从初始方向绕orgin为原点作旋转，然后求得所有瓦片编号新旋转后的坐标
-    QSet<GraphicsMap::TileSpec> curViewSet;
+    // methoad： 将矩形区域视作从初始方向绕orgin为原点作旋转，然后按行扫描旋转后的多边形，求得与其相交的所有瓦片编号
     const auto &origin = region.origin;
     const auto &type = origin.type;
     const auto &zoom = origin.zoom;
+    TileView view;
+    view.type = type;
+    view.zoom = zoom;
     {
         QMatrix rotMat;
         rotMat.rotate(region.rotation);
-        QRect boundRect = rotMat.mapRect(QRectF(0, 0, region.horCount, region.verCount)).toRect();
+        const QPolygonF polygon = rotMat.map(QPolygonF(QRectF(0, 0, region.horCount, region.verCount)));
+        const QRectF boundRect = polygon.boundingRect();
+        const int tileCount = 1 << zoom;
+        const int xOrigin = int(origin.x);
+        const int yOrigin = int(origin.y);
         // noto: y向下递增
-        const auto xMax = boundRect.x() + boundRect.width();
-        const auto yMax = boundRect.y() + boundRect.height();
-        for(auto y = boundRect.y(); y <= yMax; ++y) {
-            for(auto x = boundRect.x(); x <= xMax; ++x) {
-                curViewSet.insert({type, zoom, origin.x + x, origin.y + y});
+        view.top = qMax(0, yOrigin + qFloor(boundRect.top()));
+        const int lastRow = qMin(tileCount - 1, yOrigin + qFloor(boundRect.bottom()));
+        for(auto row = view.top; row <= lastRow; ++row) {
+            // the span of the convex polygon within the row [y, y+1]
+            const int y = row - yOrigin;
+            qreal xMin = std::numeric_limits<qreal>::max();
+            qreal xMax = std::numeric_limits<qreal>::lowest();
+            for(int i = 0; i < 4; ++i) {
+                auto p1 = polygon.at(i);
+                auto p2 = polygon.at((i+1) % 4);
+                if(p1.y() > p2.y())
+                    qSwap(p1, p2);
+                const qreal top = qMax<qreal>(y, p1.y());
+                const qreal bottom = qMin<qreal>(y+1, p2.y());
+                if(top > bottom)
+                    continue;
+                // clip the edge to the row
+                if(qFuzzyCompare(p1.y(), p2.y())) {
+                    xMin = qMin(xMin, qMin(p1.x(), p2.x()));
+                    xMax = qMax(xMax, qMax(p1.x(), p2.x()));
+                    continue;
+                }
+                const qreal slope = (p2.x() - p1.x()) / (p2.y() - p1.y());
+                const qreal x1 = p1.x() + (top - p1.y()) * slope;
+                const qreal x2 = p1.x() + (bottom - p1.y()) * slope;
+                xMin = qMin(xMin, qMin(x1, x2));
+                xMax = qMax(xMax, qMax(x1, x2));
             }
+            if(xMin > xMax)
+                view.spans.append(QPoint(0, -1));
+            else
+                view.spans.append(QPoint(qMax(0, xOrigin + qFloor(xMin)), qMin(tileCount - 1, xOrigin + qFloor(xMax))));
         }
     }
-
-    // compute which to load and which to unload
-    QSet<GraphicsMap::TileSpec> needToHideTileSet = m_tileTriedToShowdSet;
-    m_tileTriedToShowdSet.clear();
-    {
-        QSetIterator<GraphicsMap::TileSpec> iter(curViewSet);
-        while (iter.hasNext()) {
-            auto tileSpec = iter.next();
-            createAscendingTileCache(tileSpec, m_tileTriedToShowdSet);
-        }
-    }
-    QSet<GraphicsMap::TileSpec> realToHideTileSet = needToHideTileSet - m_tileTriedToShowdSet;
-
-    // update the scene tiles
-    {
-        QSetIterator<GraphicsMap::TileSpec> iter(m_tileTriedToShowdSet);
-        while (iter.hasNext()) {
-            auto &tileSpec = iter.next();
-            showItem(tileSpec);
+    updateView(sub, view);
+    // the view tiles shown in a smaller variant are decoded again in the larger size
+    if(region.tileSize > oldTileSize) {
+        for(auto row = view.top; row < view.top + view.spans.size(); ++row) {
+            const auto span = view.span(row);
+            for(auto x = span.x(); x <= span.y(); ++x) {
+                GraphicsMap::TileSpec spec{type, zoom, quint32(x), quint32(row)};
+                if(!m_tileLoading.contains(spec))
+                    sub.tileToFetch.append(spec);
+            }
         }
     }
+    sub.tilePrefetchSet.clear();
     {
-        QSetIterator<GraphicsMap::TileSpec> iter(realToHideTileSet);
-        while (iter.hasNext()) {
-            auto &tileSpec = iter.next();
-            hideItem(tileSpec);
+        const auto &rect = region.prefetchRect;
+        for(auto y = rect.top(); y <= rect.bottom(); ++y) {
+            for(auto x = rect.left(); x <= rect.right(); ++x) {
+                GraphicsMap::TileSpec spec{type, region.prefetchZoom, quint32(x), quint32(y)};
+                if(!sub.tileView.contains(spec))
+                    sub.tilePrefetchSet.insert(spec);
+            }
         }
     }
+    updateLoading();
+    refreshTile();
+    prefetchTile(sub);
 
-    emit requestFinished();
+    finishRequest(sub);
 }
 
 /// \note 该槽函数应该在多线程通过队列调用,以免多线程正在进行上一次资源路径的加载操作
 void GraphicsMapThread::requestPath(const QString &path)
 {
-    if(path == m_path)
+    if(path.isEmpty())
+        return;
+    // reuse the source of the path used before
+    const auto type = GraphicsMap::mapType(path);
+    auto source = m_sources.value(type);
+    if(!source) {
+        source.reset(TileSource::create(path));
+        source->setTMSMode(m_tmsTypes.contains(type));
+    }
+    requestSource(source);
+}
+
+void GraphicsMapThread::requestSource(const QSharedPointer<TileSource> &source)
+{
+    auto type = GraphicsMap::mapType(source->name());
+    if(m_sources.value(type) == source)
         return;
-    m_path = path;
+    if(auto oldSource = m_sources.value(type)) {
+        disconnect(oldSource.data(), &TileSource::fetched, this, &GraphicsMapThread::onTileFetched);
+        disconnect(oldSource.data(), &TileSource::failed, this, &GraphicsMapThread::onTileFailed);
+        disconnect(oldSource.data(), &TileSource::changed, this, nullptr);
+    }
+    connect(source.data(), &TileSource::fetched, this, &GraphicsMapThread::onTileFetched, Qt::QueuedConnection);
+    connect(source.data(), &TileSource::failed, this, &GraphicsMapThread::onTileFailed, Qt::QueuedConnection);
+    // tiles reported missing by the stale index may exist now
+    connect(source.data(), &TileSource::changed, this, [this, type](){
+        resetTiles(type);
+    }, Qt::QueuedConnection);
+    m_sources.insert(type, source);
+    // tiles of the replaced source will be loaded again from the new one
+    resetTiles(type);
 }
 
-void GraphicsMapThread::setTileCacheCount(const int &count)
+void GraphicsMapThread::warmupRegion(GraphicsMap *map, quint8 type, const QVector<QPair<quint8, QRect>> &levels)
 {
-    m_tileCache.setMaxCost(count);
+    auto sub = m_subscribers.value(map);
+    if(!sub)
+        return;
+    if(!sub->warmup.levels.isEmpty()) {
+        dropWarmup(*sub);
+        finishWarmup(*sub, false);
+    }
+    // tiles above the max zoom of the source are made from the tiles of max zoom
+    auto source = m_sources.value(type);
+    auto &warmup = sub->warmup;
+    warmup.type = type;
+    for(const auto &level : levels) {
+        if(source && source->maxZoom() >= 0 && level.first > source->maxZoom())
+            continue;
+        warmup.levels.append(level);
+        warmup.total += qint64(level.second.width()) * level.second.height();
+    }
+    if(!source || warmup.levels.isEmpty()) {
+        finishWarmup(*sub, !source.isNull());
+        return;
+    }
+    warmup.next = warmup.levels.first().second.topLeft();
+    warmup.reportTimer.start();
+    continueWarmup(*sub);
 }
 
-void GraphicsMapThread::setTMSMode(const bool &on)
+void GraphicsMapThread::cancelWarmup(GraphicsMap *map)
 {
-    m_bTMS = on;
+    auto sub = m_subscribers.value(map);
+    if(!sub || sub->warmup.levels.isEmpty())
+        return;
+    dropWarmup(*sub);
+    finishWarmup(*sub, false);
+}
+
+/// \note 缓存只在瓦片线程中访问，所以跨线程调用时转到瓦片线程执行
+void GraphicsMapThread::setTileCacheSize(const qint64 &bytes)
+{
+    QMetaObject::invokeMethod(this, [this, bytes](){
+        m_cacheMaxBytes.storeRelease(qMax<qint64>(0, bytes));
+        updateCacheCost();
+    });
+}
+
+/// \note 降低常驻层级时，超出层级的常驻瓦片转回可淘汰缓存；提高常驻层级时，新常驻层级的瓦片移出可淘汰缓存
+void GraphicsMapThread::setPinnedZoom(const int &zoom)
+{
+    QMetaObject::invokeMethod(this, [this, zoom](){
+        m_pinnedZoom = zoom;
+        QVector<quint64> keys;
+        m_tileCache.forEach([this, &keys](quint64 key, TileCacheNode *&node){
+            if(node->tileSpec.zoom <= m_pinnedZoom)
+                keys.append(key);
+        });
+        for(auto key : keys) {
+            auto node = m_tileCache.take(key);
+            m_tileCacheCost -= node->cost();
+            // pinned tiles keep their own images, see onTileDecoded
+            unshareImage(node);
+            m_pinnedCache.insert(node->tileSpec, node);
+            m_pinnedBytes += node->bytes;
+        }
+        QList<TileCacheNode*> unpinned;
+        for(auto iter = m_pinnedCache.begin(); iter != m_pinnedCache.end();) {
+            if(iter.key().zoom > m_pinnedZoom) {
+                unpinned.append(iter.value());
+                m_pinnedBytes -= iter.value()->bytes;
+                iter = m_pinnedCache.erase(iter);
+            }
+            else
+                ++iter;
+        }
+        updateCacheCost();
+        for(auto node : unpinned) {
+            insertCacheNode(node);
+        }
+    });
+}
+
+void GraphicsMapThread::setDataCacheSize(const qint64 &bytes)
+{
+    QMetaObject::invokeMethod(this, [this, bytes](){
+        m_dataCacheMaxBytes.storeRelease(qMax<qint64>(0, bytes));
+        updateDataCacheCost();
+    });
+}
+
+/// \note 解码任务持有共享缓存的引用，替换后原来的共享内存在这些任务结束后断开
+void GraphicsMapThread::setSharedCache(const QString &key, const qint64 &bytes)
+{
+    QMetaObject::invokeMethod(this, [this, key, bytes](){
+        QSharedPointer<SharedTileCache> sharedCache;
+        if(!key.isEmpty() && bytes > 0) {
+            sharedCache.reset(new SharedTileCache(key));
+            if(!sharedCache->attach(bytes))
+                sharedCache.reset();
+        }
+        QMutexLocker locker(&m_sharedCacheMutex);
+        m_sharedCache = sharedCache;
+    });
+}
+
+GraphicsMap::TileCacheStats GraphicsMapThread::cacheStats(GraphicsMap::TileCacheTier tier) const
+{
+    if(tier == GraphicsMap::CompressedTier)
+        return {m_dataCacheBytes.loadAcquire(), m_dataCachePeakBytes.loadAcquire(), m_dataCacheMaxBytes.loadAcquire(),
+                    m_dataCacheHits.loadAcquire(), m_dataCacheMisses.loadAcquire()};
+    // the segment is allocated as a whole when attached
+    if(tier == GraphicsMap::SharedTier) {
+        QSharedPointer<SharedTileCache> sharedCache;
+        {
+            QMutexLocker locker(&m_sharedCacheMutex);
+            sharedCache = m_sharedCache;
+        }
+        if(!sharedCache)
+            return {0, 0, 0, 0, 0};
+        return {sharedCache->size(), sharedCache->size(), sharedCache->size(), sharedCache->hits(), sharedCache->misses()};
+    }
+    return {m_cacheBytes.loadAcquire(), m_cachePeakBytes.loadAcquire(), m_cacheMaxBytes.loadAcquire(),
+                m_cacheHits.loadAcquire(), m_cacheMisses.loadAcquire()};
+}
+
+qint64 GraphicsMapThread::decodeLatency() const
+{
+    return m_decodeLatency.loadAcquire();
+}
+
+int GraphicsMapThread::loadingCount() const
+{
+    return m_loadingCount.loadAcquire();
+}
+
+void GraphicsMapThread::setDecodeThreadCount(const int &count)
+{
+    m_decodePool.setMaxThreadCount(qMax(1, count));
+}
+
+void GraphicsMapThread::setTMSMode(quint8 type, bool on)
+{
+    QMetaObject::invokeMethod(this, [this, type, on](){
+        if(on)
+            m_tmsTypes.insert(type);
+        else
+            m_tmsTypes.remove(type);
+        auto source = m_sources.value(type);
+        if(!source || source->isTMSMode() == on)
+            return;
+        source->setTMSMode(on);
+        // the same tile spec is read from the y-flipped tile now
+        resetTiles(type);
+    });
 }
 
-void GraphicsMapThread::showItem(const GraphicsMap::TileSpec &tileSpec)
+void GraphicsMapThread::showItem(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec)
 {
-    if(m_tileShowedSet.contains(tileSpec))
+    if(sub.tileShowedSet.contains(tileSpec))
         return;
 
-    auto tileItem = m_tileCache.object(tileSpec);
-    if(tileItem->value) {
-        emit tileToAdd(tileItem->value);
-        m_tileShowedSet.insert(tileSpec);
+    auto tileItem = cacheNode(tileSpec);
+    if(tileItem && !tileItem->image.isNull()) {
+        sub.tileDelta.added.append(qMakePair(tileSpec, tileItem->image));
+        sub.tileShowedSet.insert(tileSpec);
     }
 }
 
-void GraphicsMapThread::hideItem(const GraphicsMap::TileSpec &tileSpec)
+void GraphicsMapThread::hideItem(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec)
 {
     // 看不见的直接不管
-    if(!m_tileShowedSet.contains(tileSpec))
+    if(!sub.tileShowedSet.contains(tileSpec))
         return;
 
-    auto tileItem = m_tileCache.object(tileSpec);
-    if(tileItem->value) {
-        emit tileToRemove(tileItem->value);
-        m_tileShowedSet.remove(tileSpec);
+    sub.tileDelta.removed.append(tileSpec);
+    sub.tileShowedSet.remove(tileSpec);
+}
+
+/// \details 同一层级平移时只有进入和离开视图的条带需要处理，计算量与变化量成正比
+void GraphicsMapThread::updateView(TileSubscriber &sub, const TileView &view)
+{
+    const TileView oldView = sub.tileView;
+    sub.tileView = view;
+    const bool sameLevel = oldView.type == view.type && oldView.zoom == view.zoom;
+    // the tiles entered are walked first, so that the parents shared with the tiles left are never hidden
+    for(auto row = view.top; row < view.top + view.spans.size(); ++row) {
+        const auto span = view.span(row);
+        const auto except = sameLevel ? oldView.span(row) : QPoint(0, -1);
+        for(auto x = span.x(); x <= span.y(); ++x) {
+            if(x >= except.x() && x <= except.y()) {
+                x = except.y();
+                continue;
+            }
+            addViewTile(sub, {view.type, view.zoom, quint32(x), quint32(row)});
+        }
+    }
+    for(auto row = oldView.top; row < oldView.top + oldView.spans.size(); ++row) {
+        const auto span = oldView.span(row);
+        const auto except = sameLevel ? view.span(row) : QPoint(0, -1);
+        for(auto x = span.x(); x <= span.y(); ++x) {
+            if(x >= except.x() && x <= except.y()) {
+                x = except.y();
+                continue;
+            }
+            removeViewTile(sub, {oldView.type, oldView.zoom, quint32(x), quint32(row)});
+        }
     }
 }
 
-/*!
- * \brief MudMapThread::loadTileItem
- * \note QTransform的srt顺序对结果有影响，并且和三维矩阵用法不一样，
- * 在该函数实现中，先scale再translate，可以理解成将瓦片按照原始大小排列在矩形中(比如1层有四张瓦片，那么排列在256*4->256*4的矩形中)，
- * 然后这个矩形从右下角整个向左上角缩放达到和sceneRect()正好重合，以实现所有不同zoom的瓦片都重叠在sceneRect()上，也达到了缺省瓦片通过上层瓦片显示的效果。
- * 为了方便经纬度和场景坐标的转换，这里将经纬度（0，0）映射在了场景坐标的（0，0）处，所以注意xOff和yOff是先移动到以（0，0）为原点的位置，再向左上移动半个场景的宽度和高度
- */
-QGraphicsPixmapItem *GraphicsMapThread::loadTileItem(const GraphicsMap::TileSpec &tileSpec)
+/// \note 正在加载的瓦片也继续向上查找，以便用已缓存的上层瓦片代替显示
+void GraphicsMapThread::addViewTile(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec)
 {
-    int tileCount = qPow(2, tileSpec.zoom);
-    //
-    QString fileName = QString("%1/%2/%3/%4")
-            .arg(m_path)
-            .arg(tileSpec.zoom)
-            .arg(tileSpec.x)
-            .arg(m_bTMS ? tileCount - tileSpec.y - 1 : tileSpec.y);
-    if(QFileInfo::exists(fileName+".jpg"))
-        fileName += ".jpg";
-    else if(QFileInfo::exists(fileName+".png"))
-        fileName += ".png";
-    else
-        return nullptr;
+    auto spec = tileSpec;
+    auto key = tileSpec.toKey();
+    forever {
+        auto &ref = sub.tileRefs[key];
+        // the tiles above have been walked through already if it's referenced
+        if(ref.refs++ == 0) {
+            auto node = cacheNode(spec);
+            if(node)
+                m_cacheHits.fetchAndAddRelaxed(1);
+            else
+                m_cacheMisses.fetchAndAddRelaxed(1);
+            ref.solid = node && !node->image.isNull();
+            // overzoomed tiles between the max zoom and the view zoom are never made, see refreshOverzoom
+            const bool overzoom = isOverzoom(spec);
+            const bool intermediate = overzoom && spec.zoom != tileSpec.zoom;
+            if(ref.solid) {
+                showItem(sub, spec);
+                // a smaller variant is shown until the one in needed size is decoded
+                if(node->resolution() < tileDecodeSize(sub, spec) && !intermediate && !m_tileLoading.contains(spec))
+                    sub.tileToFetch.append(spec);
+            }
+            else if(!node && !m_tileLoading.contains(spec)) {
+                auto source = m_sources.value(spec.type);
+                // tiles known to be missing cost no I/O and no decode task
+                if(overzoom) {
+                    if(!intermediate)
+                        sub.tileToFetch.append(spec);
+                }
+                else if(source && source->availability(spec) == TileSource::Unavailable) {
+                    auto emptyNode = new GraphicsMapThread::TileCacheNode;
+                    emptyNode->tileSpec = spec;
+                    insertCacheNode(emptyNode);
+                }
+                else
+                    sub.tileToFetch.append(spec);
+            }
+        }
+        if(ref.solid || spec.zoom == 0)
+            return;
+        spec = spec.rise();
+        key = TileTable<TileRef>::parentKey(key);
+    }
+}
 
-    auto tileItem = new QGraphicsPixmapItem(fileName);
-    tileItem->setZValue(tileSpec.zoom - 20);
+/// \note 瓦片的solid状态只在solidifyTile中改变，所以离开时的路径与进入时相同
+void GraphicsMapThread::removeViewTile(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec)
+{
+    auto spec = tileSpec;
+    auto key = tileSpec.toKey();
+    while(!releaseTile(sub, spec, key, 1) && spec.zoom > 0) {
+        spec = spec.rise();
+        key = TileTable<TileRef>::parentKey(key);
+    }
+}
 
-    //
-    double xOff = TILE_LEN * (tileSpec.x  - tileCount/2.0);     // see also: TILE_LEN * tileSpec.x - (TILE_LEN*tileCount) / 2;
-    double yOff = TILE_LEN * (tileSpec.y  - tileCount/2.0);     // see also: TILE_LEN * tileSpec.y - (TILE_LEN*tileCount) / 2;
-    double scaleFac = 1.0 / qPow(2, (tileSpec.zoom-ZOOM_BASE));
-    QTransform transform;
-    transform.scale(scaleFac, scaleFac)
-            .translate(xOff, yOff);
-    tileItem->setTransform(transform);
-    return tileItem;
+bool GraphicsMapThread::releaseTile(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec, quint64 key, int count)
+{
+    auto ref = sub.tileRefs.find(key);
+    if(!ref)
+        return true;
+    const bool solid = ref->solid;
+    ref->refs -= count;
+    if(ref->refs <= 0) {
+        sub.tileRefs.remove(key);
+        hideItem(sub, tileSpec);
+    }
+    return solid;
 }
 
-void GraphicsMapThread::createAscendingTileCache(const GraphicsMap::TileSpec &tileSpec, QSet<GraphicsMap::TileSpec> &sets)
+/// \note 瓦片被缓存淘汰后仍保留solid状态，因为GUI线程仍在显示它
+void GraphicsMapThread::solidifyTile(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec)
 {
-    auto tileCacheItem = m_tileCache.object(tileSpec);
+    auto key = tileSpec.toKey();
+    auto ref = sub.tileRefs.find(key);
+    if(!ref || ref->solid)
+        return;
+    ref->solid = true;
+    const int count = ref->refs;
+    showItem(sub, tileSpec);
+    // all the tiles walking through it went on along the same path above
+    auto spec = tileSpec;
+    while(spec.zoom > 0) {
+        spec = spec.rise();
+        key = TileTable<TileRef>::parentKey(key);
+        if(releaseTile(sub, spec, key, count))
+            return;
+    }
+}
 
+/// \details 加载由所有订阅者共享，按需要它的订阅者中的最高优先级排队
+void GraphicsMapThread::updateLoading()
+{
+    // tiles no longer wanted by any map are dropped if they have not been started,
+    // and those still wanted are marked with current generation and requeued by the new focus
+    for(auto iter = m_tileLoading.begin(); iter != m_tileLoading.end();) {
+        const auto priority = loadPriority(iter.key());
+        if(priority == UNWANTED_PRIORITY) {
+            if(cancelTile(iter.key(), iter.value()))
+                iter = m_tileLoading.erase(iter);
+            else
+                ++iter;
+            continue;
+        }
+        auto &load = iter.value();
+        load.generation = m_generation;
+        if(load.priority != priority) {
+            load.priority = priority;
+            auto source = m_sources.value(iter.key().type);
+            if(load.decodeTask) {
+                if(m_decodePool.tryTake(load.decodeTask))
+                    m_decodePool.start(load.decodeTask, priority);
+            }
+            else if(source && source->cancel(iter.key()))
+                source->fetch(iter.key(), priority);
+        }
+        ++iter;
+    }
+}
+
+void GraphicsMapThread::refreshTile()
+{
+    MAP_TRACE_SCOPE("refreshTile");
+    m_refreshPending = false;
+    for(auto sub : m_subscribers) {
+        // tiles sharing a decoded image complete at once and may queue more tiles
+        QVector<GraphicsMap::TileSpec> toFetch;
+        qSwap(toFetch, sub->tileToFetch);
+        // the most useful tiles are started first, the rest are queued by priority
+        std::sort(toFetch.begin(), toFetch.end(), [this, sub](const GraphicsMap::TileSpec &lhs, const GraphicsMap::TileSpec &rhs){
+            return tilePriority(*sub, lhs) > tilePriority(*sub, rhs);
+        });
+        for(const auto &tileSpec : toFetch) {
+            // it may have left the view or been loaded since
+            if(!sub->tileRefs.contains(tileSpec.toKey()) || m_tileLoading.contains(tileSpec) || !needsDecode(*sub, tileSpec))
+                continue;
+            fetchTile(tileSpec, tilePriority(*sub, tileSpec), tileDecodeSize(*sub, tileSpec));
+        }
+    }
+    for(auto sub : m_subscribers) {
+        if(!sub->tileToFetch.isEmpty())
+            scheduleRefresh();
+        flushDelta(*sub);
+    }
+    m_loadingCount.storeRelease(m_tileLoading.size());
+}
+
+void GraphicsMapThread::flushDelta(TileSubscriber &sub)
+{
+    if(sub.tileDelta.isEmpty())
+        return;
+    auto map = sub.map;
+    auto delta = sub.tileDelta;
+    QMetaObject::invokeMethod(map, [map, delta](){
+        map->applyTileDelta(delta);
+    }, Qt::QueuedConnection);
+    sub.tileDelta = GraphicsMap::TileDelta();
+}
+
+void GraphicsMapThread::finishRequest(TileSubscriber &sub)
+{
+    auto map = sub.map;
+    QMetaObject::invokeMethod(map, [map](){
+        map->finishTileRequest();
+    }, Qt::QueuedConnection);
+}
+
+void GraphicsMapThread::scheduleRefresh()
+{
+    if(m_refreshPending)
+        return;
+    m_refreshPending = true;
+    QMetaObject::invokeMethod(this, [this](){
+        refreshTile();
+    }, Qt::QueuedConnection);
+}
+
+void GraphicsMapThread::fetchTile(const GraphicsMap::TileSpec &tileSpec, int priority, int size)
+{
+    auto source = m_sources.value(tileSpec.type);
+    if(!source)
+        return;
+    TileLoad load;
+    load.generation = m_generation;
+    load.priority = priority;
+    load.size = size;
+    // overzoomed tiles are made from the tile of max zoom, which is fetched as a parent if not cached
+    if(isOverzoom(tileSpec)) {
+        const auto dz = tileSpec.zoom - source->maxZoom();
+        const GraphicsMap::TileSpec parentSpec{tileSpec.type, quint8(source->maxZoom()), tileSpec.x >> dz, tileSpec.y >> dz};
+        auto parent = cacheNode(parentSpec);
+        if(!parent || parent->image.isNull())
+            return;
+        // a solid parent gives the same fill to all its overzoomed tiles
+        if(isFill(parent->image)) {
+            const QImage fill = parent->image;
+            m_tileLoading.insert(tileSpec, load);
+            onTileDecoded(tileSpec, fill);
+            return;
+        }
+        const int len = qMax(1, parent->image.width() >> dz);
+        const QRect rect((tileSpec.x & ((1u << dz) - 1)) * len, (tileSpec.y & ((1u << dz) - 1)) * len, len, len);
+        load.decodeTask = new TileDecodeTask(this, tileSpec, parent->image, rect, load.size);
+        m_tileLoading.insert(tileSpec, load);
+        m_decodePool.start(load.decodeTask, load.priority);
+        return;
+    }
+    // another process may have decoded it already
+    if(m_sharedCache) {
+        const auto image = m_sharedCache->find(sharedCacheName(source.data()), tileSpec.zoom, tileSpec.x, tileSpec.y);
+        if(!image.isNull() && (isFill(image) || image.width() >= size)) {
+            m_tileLoading.insert(tileSpec, load);
+            onTileDecoded(tileSpec, image);
+            return;
+        }
+    }
+    // the compressed bytes read before need only a decode
+    auto data = m_dataCache.find(tileSpec.toKey());
+    if(data) {
+        m_dataCacheHits.fetchAndAddRelaxed(1);
+        const QByteArray bytes = *data;
+        m_tileLoading.insert(tileSpec, load);
+        decodeTile(tileSpec, bytes);
+        return;
+    }
+    m_dataCacheMisses.fetchAndAddRelaxed(1);
+    m_tileLoading.insert(tileSpec, load);
+    // a tile being warmed up is read only once, at the higher priority
+    if(m_warmLoading.contains(tileSpec) && !source->cancel(tileSpec))
+        return;
+    source->fetch(tileSpec, load.priority);
+}
+
+/// \note 预取瓦片最多占用缓存空余空间的一半，避免预取的瓦片把即将使用的瓦片挤出缓存，空余空间扣除所有订阅者引用的瓦片
+void GraphicsMapThread::prefetchTile(TileSubscriber &sub)
+{
+    QVector<GraphicsMap::TileSpec> toPrefetch;
+    for(const auto &tileSpec : sub.tilePrefetchSet) {
+        if(m_pinnedCache.contains(tileSpec) || m_tileCache.contains(tileSpec.toKey()) || m_tileLoading.contains(tileSpec))
+            continue;
+        auto source = m_sources.value(tileSpec.type);
+        if(!source || source->availability(tileSpec) == TileSource::Unavailable)
+            continue;
+        toPrefetch.append(tileSpec);
+    }
+    qint64 referenced = 0;
+    for(auto subscriber : m_subscribers) {
+        referenced += subscriber->tileRefs.size();
+    }
+    const qint64 spare = (m_cacheMaxBytes.loadAcquire() - m_pinnedBytes) / TILE_BYTES - referenced - m_tileLoading.size();
+    const int count = qBound<qint64>(0, spare / 2, toPrefetch.size());
+    if(count < toPrefetch.size()) {
+        std::partial_sort(toPrefetch.begin(), toPrefetch.begin() + count, toPrefetch.end(), [this, &sub](const GraphicsMap::TileSpec &lhs, const GraphicsMap::TileSpec &rhs){
+            return tilePriority(sub, lhs) > tilePriority(sub, rhs);
+        });
+        toPrefetch.resize(count);
+    }
+    for(const auto &tileSpec : toPrefetch) {
+        fetchTile(tileSpec, tilePriority(sub, tileSpec) - PREFETCH_PRIORITY, tileDecodeSize(sub, tileSpec));
+    }
+}
+
+/// \details 已缓存、正在加载或确定不存在的瓦片直接计为完成。预热的数据量达到压缩数据缓存上限后停止，
+/// 否则后面的瓦片会把先预热的瓦片挤出缓存
+void GraphicsMapThread::continueWarmup(TileSubscriber &sub)
+{
+    auto &warmup = sub.warmup;
+    if(warmup.levels.isEmpty())
+        return;
+    auto source = m_sources.value(warmup.type);
+    GraphicsMap::TileSpec tileSpec;
+    while(source && warmup.loading < WARMUP_CONCURRENCY && warmup.bytes < m_dataCacheMaxBytes.loadAcquire()
+          && nextWarmupTile(warmup, tileSpec)) {
+        const auto key = tileSpec.toKey();
+        // looking up the compressed tier marks the tile as recently used
+        if(m_dataCache.find(key) || cacheNode(tileSpec) || m_tileLoading.contains(tileSpec) || m_warmLoading.contains(tileSpec)
+                || source->availability(tileSpec) == TileSource::Unavailable) {
+            ++warmup.done;
+            continue;
+        }
+        m_warmLoading.insert(tileSpec, &sub);
+        ++warmup.loading;
+        source->fetch(tileSpec, WARMUP_PRIORITY);
+    }
+    if(warmup.loading > 0) {
+        if(warmup.reportTimer.elapsed() >= WARMUP_REPORT_INTERVAL)
+            reportWarmup(sub);
+        return;
+    }
+    finishWarmup(sub, source && warmup.done >= warmup.total);
+}
+
+bool GraphicsMapThread::nextWarmupTile(TileWarmup &warmup, GraphicsMap::TileSpec &tileSpec)
+{
+    while(warmup.level < warmup.levels.size()) {
+        const auto &level = warmup.levels.at(warmup.level);
+        if(warmup.next.y() > level.second.bottom()) {
+            if(++warmup.level < warmup.levels.size())
+                warmup.next = warmup.levels.at(warmup.level).second.topLeft();
+            continue;
+        }
+        tileSpec = {warmup.type, level.first, quint32(warmup.next.x()), quint32(warmup.next.y())};
+        if(warmup.next.x() < level.second.right())
+            warmup.next.rx()++;
+        else
+            warmup.next = QPoint(level.second.left(), warmup.next.y() + 1);
+        return true;
+    }
+    return false;
+}
+
+/// \note 同时作为显示瓦片加载的读取不取消，读取结果仍然进入压缩数据缓存
+void GraphicsMapThread::dropWarmup(TileSubscriber &sub)
+{
+    for(auto iter = m_warmLoading.begin(); iter != m_warmLoading.end();) {
+        if(iter.value() != &sub) {
+            ++iter;
+            continue;
+        }
+        auto source = m_sources.value(iter.key().type);
+        if(source && !m_tileLoading.contains(iter.key()))
+            source->cancel(iter.key());
+        iter = m_warmLoading.erase(iter);
+    }
+}
+
+void GraphicsMapThread::finishWarmup(TileSubscriber &sub, bool completed)
+{
+    reportWarmup(sub);
+    sub.warmup = TileWarmup();
+    auto map = sub.map;
+    QMetaObject::invokeMethod(map, [map, completed](){
+        emit map->prefetchFinished(completed);
+    }, Qt::QueuedConnection);
+}
+
+void GraphicsMapThread::reportWarmup(TileSubscriber &sub)
+{
+    sub.warmup.reportTimer.restart();
+    auto map = sub.map;
+    const auto done = sub.warmup.done;
+    const auto total = sub.warmup.total;
+    QMetaObject::invokeMethod(map, [map, done, total](){
+        emit map->prefetchProgress(done, total);
+    }, Qt::QueuedConnection);
+}
+
+int GraphicsMapThread::tileDecodeSize(const TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec) const
+{
+    return tileSpec.zoom < sub.tileRegion.origin.zoom ? TILE_LEN : sub.tileRegion.tileSize;
+}
+
+bool GraphicsMapThread::needsDecode(const TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec)
+{
+    auto node = cacheNode(tileSpec);
+    return !node || (!node->image.isNull() && node->resolution() < tileDecodeSize(sub, tileSpec));
+}
+
+bool GraphicsMapThread::isOverzoom(const GraphicsMap::TileSpec &tileSpec) const
+{
+    auto source = m_sources.value(tileSpec.type);
+    return source && source->maxZoom() >= 0 && tileSpec.zoom > source->maxZoom();
+}
+
+/// \note 只处理视图层级的瓦片，中间层级的瓦片不需要生成
+void GraphicsMapThread::refreshOverzoom(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec)
+{
+    auto source = m_sources.value(tileSpec.type);
+    const auto &view = sub.tileView;
+    if(!source || tileSpec.zoom != source->maxZoom() || view.type != tileSpec.type || view.zoom <= tileSpec.zoom)
+        return;
+    const int dz = view.zoom - tileSpec.zoom;
+    const int xFirst = int(tileSpec.x) << dz;
+    const int yFirst = int(tileSpec.y) << dz;
+    const int last = (1 << dz) - 1;
+    const int rowEnd = qMin(yFirst + last, view.top + view.spans.size() - 1);
+    for(auto row = qMax(yFirst, view.top); row <= rowEnd; ++row) {
+        const auto span = view.span(row);
+        for(auto x = qMax(xFirst, span.x()); x <= qMin(xFirst + last, span.y()); ++x) {
+            GraphicsMap::TileSpec spec{tileSpec.type, view.zoom, quint32(x), quint32(row)};
+            if(sub.tileRefs.contains(spec.toKey()) && !m_tileLoading.contains(spec))
+                sub.tileToFetch.append(spec);
+        }
+    }
+}
+
+/// \details 焦点距离按请求层级的瓦片单位计算，焦点落在瓦片内时距离为0。
+/// 上层瓦片作为缺省显示覆盖范围大，所以先按层级排序，再按距离排序
+int GraphicsMapThread::tilePriority(const TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec) const
+{
+    const auto scale = std::ldexp(1.0, sub.tileRegion.origin.zoom - tileSpec.zoom);
+    const QRectF tileRect(tileSpec.x * scale, tileSpec.y * scale, scale, scale);
+    const auto &focus = sub.tileRegion.focus;
+    const auto dx = qMax(0.0, qMax(tileRect.left() - focus.x(), focus.x() - tileRect.right()));
+    const auto dy = qMax(0.0, qMax(tileRect.top() - focus.y(), focus.y() - tileRect.bottom()));
+    const int distance = qMin(qSqrt(dx*dx + dy*dy) * 64, qreal(0xFFFFF));
+    return ((32 - tileSpec.zoom) << 20) - distance;
+}
+
+int GraphicsMapThread::loadPriority(const GraphicsMap::TileSpec &tileSpec) const
+{
+    int priority = UNWANTED_PRIORITY;
+    for(auto sub : m_subscribers) {
+        if(sub->tileRefs.contains(tileSpec.toKey()))
+            priority = qMax(priority, tilePriority(*sub, tileSpec));
+        else if(sub->tilePrefetchSet.contains(tileSpec))
+            priority = qMax(priority, tilePriority(*sub, tileSpec) - PREFETCH_PRIORITY);
+    }
+    return priority;
+}
+
+bool GraphicsMapThread::cancelTile(const GraphicsMap::TileSpec &tileSpec, const TileLoad &load)
+{
+    if(load.decodeTask) {
+        if(!m_decodePool.tryTake(load.decodeTask))
+            return false;
+        delete load.decodeTask;
+        return true;
+    }
+    auto source = m_sources.value(tileSpec.type);
+    if(!source)
+        return false;
+    // the read still goes on for the warmup, at its own priority
+    if(m_warmLoading.contains(tileSpec)) {
+        if(source->cancel(tileSpec))
+            source->fetch(tileSpec, WARMUP_PRIORITY);
+        return true;
+    }
+    return source->cancel(tileSpec);
+}
+
+void GraphicsMapThread::onTileFetched(const GraphicsMap::TileSpec &tileSpec, const QByteArray &data)
+{
+    auto warmSub = m_warmLoading.take(tileSpec);
+    const bool loading = m_tileLoading.contains(tileSpec) && !m_tileLoading.value(tileSpec).decodeTask;
+    // it has been canceled or it's from a replaced source
+    if(!warmSub && !loading)
+        return;
+    if(!data.isEmpty())
+        insertDataCache(tileSpec, data);
+    // the warmup only fills the compressed tier
+    if(warmSub) {
+        auto &warmup = warmSub->warmup;
+        warmup.bytes += data.size();
+        --warmup.loading;
+        ++warmup.done;
+        continueWarmup(*warmSub);
+    }
+    if(!loading)
+        return;
+    auto iter = m_tileLoading.find(tileSpec);
+    // the read could not be canceled, but the decode of a superseded tile can be skipped
+    if(iter.value().generation != m_generation && loadPriority(tileSpec) == UNWANTED_PRIORITY) {
+        m_tileLoading.erase(iter);
+        return;
+    }
+    if(data.isEmpty()) {
+        onTileDecoded(tileSpec, QImage());
+        return;
+    }
+    decodeTile(tileSpec, data);
+}
+
+/// \details 失败不代表瓦片不存在，所以不放入任何缓存，正在显示的上层瓦片继续代替显示，
+/// 间隔FETCH_RETRY_INTERVAL后仍在视图中的瓦片重新读取；预热瓦片计为已处理
+void GraphicsMapThread::onTileFailed(const GraphicsMap::TileSpec &tileSpec)
+{
+    if(auto warmSub = m_warmLoading.take(tileSpec)) {
+        auto &warmup = warmSub->warmup;
+        --warmup.loading;
+        ++warmup.done;
+        continueWarmup(*warmSub);
+    }
+    auto iter = m_tileLoading.find(tileSpec);
+    if(iter == m_tileLoading.end() || iter.value().decodeTask)
+        return;
+    m_tileLoading.erase(iter);
+    m_loadingCount.storeRelease(m_tileLoading.size());
+    QTimer::singleShot(FETCH_RETRY_INTERVAL, this, [this, tileSpec](){
+        for(auto sub : m_subscribers) {
+            if(sub->tileRefs.contains(tileSpec.toKey()))
+                sub->tileToFetch.append(tileSpec);
+        }
+        scheduleRefresh();
+    });
+}
+
+/// \details 瓦片包中大量瓦片内容完全相同(海洋、空白陆地)，按压缩数据的摘要查找已解码的图片，
+/// 命中、压缩数据相同且分辨率足够时不再解码，直接完成加载
+void GraphicsMapThread::decodeTile(const GraphicsMap::TileSpec &tileSpec, const QByteArray &data)
+{
+    auto &load = m_tileLoading[tileSpec];
+    load.digest = tileDigest(data);
+    load.data = data;
+    auto shared = m_sharedImages.constFind(load.digest);
+    if(shared != m_sharedImages.constEnd() && shared->data == data
+            && (isFill(shared->image) || shared->image.width() >= load.size)) {
+        const QImage image = shared->image;
+        onTileDecoded(tileSpec, image);
+        return;
+    }
+    load.decodeTask = new TileDecodeTask(this, tileSpec, data, load.size);
+    auto source = m_sources.value(tileSpec.type);
+    if(m_sharedCache && source)
+        load.decodeTask->setSharedCache(m_sharedCache, sharedCacheName(source.data()));
+    m_decodePool.start(load.decodeTask, load.priority);
+}
+
+/// \details 图片放入共享缓存后通知所有订阅者，解码尺寸小于某个订阅者所需尺寸时为它再次加载
+void GraphicsMapThread::onTileDecoded(const GraphicsMap::TileSpec &tileSpec, const QImage &image, TileDecodeTask *task)
+{
+    quint64 digest = 0;
+    QByteArray data;
+    int size = 0;
+    auto iter = m_tileLoading.find(tileSpec);
+    if(iter != m_tileLoading.end() && iter.value().decodeTask == task) {
+        digest = iter.value().digest;
+        data = iter.value().data;
+        size = iter.value().size;
+        m_tileLoading.erase(iter);
+        m_loadingCount.storeRelease(m_tileLoading.size());
+    }
+    else if(task) {
+        // it was dropped by resetTiles while decoding, the image is from the old source
+        delete task;
+        return;
+    }
+    delete task;
+    // never replace a larger variant with a smaller one decoded for an earlier region
+    auto oldNode = cacheNode(tileSpec);
+    if(oldNode && !oldNode->image.isNull()
+            && oldNode->resolution() >= (isFill(image) ? std::numeric_limits<int>::max() : image.width()))
+        return;
+    auto node = new GraphicsMapThread::TileCacheNode;
+    node->tileSpec = tileSpec;
+    node->image = image;
+    // pinned tiles are few and never evicted, they keep their own images
+    if(digest && !image.isNull() && tileSpec.zoom > m_pinnedZoom)
+        shareImage(node, digest, data);
+    insertCacheNode(node);
+    bool changed = false;
+    for(auto sub : m_subscribers) {
+        if(!image.isNull()) {
+            // the smaller variant on screen is replaced
+            if(sub->tileShowedSet.contains(tileSpec)) {
+                hideItem(*sub, tileSpec);
+                showItem(*sub, tileSpec);
+            }
+            solidifyTile(*sub, tileSpec);
+            refreshOverzoom(*sub, tileSpec);
+            // another map shows it larger than the size it was loaded for
+            if(size < tileDecodeSize(*sub, tileSpec) && sub->tileRefs.contains(tileSpec.toKey()) && needsDecode(*sub, tileSpec))
+                sub->tileToFetch.append(tileSpec);
+        }
+        changed |= !sub->tileDelta.isEmpty() || !sub->tileToFetch.isEmpty();
+    }
+    // only those tiles still wanted make the view change
+    if(changed)
+        scheduleRefresh();
+}
+
+GraphicsMapThread::TileCacheNode *GraphicsMapThread::cacheNode(const GraphicsMap::TileSpec &tileSpec)
+{
+    auto node = m_pinnedCache.value(tileSpec);
+    if(node)
+        return node;
+    auto cached = m_tileCache.find(tileSpec.toKey());
+    return cached ? *cached : nullptr;
+}
+
+void GraphicsMapThread::insertCacheNode(TileCacheNode *node)
+{
+    // count memory for newly created node only
+    if(!node->usage) {
+        node->bytes = node->digest ? 0 : node->image.sizeInBytes();
+        node->usage = &m_cacheBytes;
+        auto bytes = m_cacheBytes.fetchAndAddRelaxed(node->bytes) + node->bytes;
+        if(bytes > m_cachePeakBytes.loadAcquire())
+            m_cachePeakBytes.storeRelease(bytes);
+    }
     //
-    if(!tileCacheItem) {
-        tileCacheItem = new GraphicsMapThread::TileCacheNode;
-        tileCacheItem->value = loadTileItem(tileSpec);
-        tileCacheItem->tileSpec = tileSpec;
-        m_tileCache.insert(tileSpec, tileCacheItem);
+    if(node->tileSpec.zoom <= m_pinnedZoom) {
+        auto oldNode = m_pinnedCache.take(node->tileSpec);
+        if(oldNode) {
+            m_pinnedBytes -= oldNode->bytes;
+            releaseCacheNode(oldNode);
+        }
+        m_pinnedCache.insert(node->tileSpec, node);
+        m_pinnedBytes += node->bytes;
+        updateCacheCost();
+    }
+    else {
+        const auto key = node->tileSpec.toKey();
+        auto oldNode = m_tileCache.take(key);
+        if(oldNode) {
+            m_tileCacheCost -= oldNode->cost();
+            releaseCacheNode(oldNode);
+        }
+        m_tileCache.insert(key, node);
+        m_tileCacheCost += node->cost();
+        updateCacheCost();
+    }
+}
+
+void GraphicsMapThread::insertDataCache(const GraphicsMap::TileSpec &tileSpec, const QByteArray &data)
+{
+    if(m_dataCacheMaxBytes.loadAcquire() <= 0)
+        return;
+    const auto key = tileSpec.toKey();
+    const auto oldSize = m_dataCache.take(key).size();
+    m_dataCache.insert(key, data);
+    auto cacheBytes = m_dataCacheBytes.fetchAndAddRelaxed(data.size() - oldSize) + data.size() - oldSize;
+    if(cacheBytes > m_dataCachePeakBytes.loadAcquire())
+        m_dataCachePeakBytes.storeRelease(cacheBytes);
+    updateDataCacheCost();
+}
+
+void GraphicsMapThread::updateDataCacheCost()
+{
+    while(m_dataCacheBytes.loadAcquire() > m_dataCacheMaxBytes.loadAcquire() && !m_dataCache.isEmpty()) {
+        auto data = m_dataCache.take(m_dataCache.evictCandidate());
+        m_dataCacheBytes.fetchAndSubRelaxed(data.size());
+    }
+}
+
+void GraphicsMapThread::removeDataCache(quint8 type)
+{
+    QVector<quint64> keys;
+    m_dataCache.forEach([&keys, type](quint64 key, QByteArray &){
+        if(quint8(key >> 56) == type)
+            keys.append(key);
+    });
+    for(auto key : keys) {
+        m_dataCacheBytes.fetchAndSubRelaxed(m_dataCache.take(key).size());
+    }
+}
+
+/// \details 同一瓦片编号在新的数据源或协议下对应不同的图片，所以表示瓦片不存在的空节点和常驻瓦片也一并删除；
+/// 进程间共享缓存按数据源名称和协议区分(参见sharedCacheName)，无需删除
+void GraphicsMapThread::resetTiles(quint8 type)
+{
+    auto source = m_sources.value(type);
+    // the decodes already running are discarded when they complete
+    for(auto iter = m_tileLoading.begin(); iter != m_tileLoading.end();) {
+        if(iter.key().type != type) {
+            ++iter;
+            continue;
+        }
+        if(iter.value().decodeTask) {
+            if(m_decodePool.tryTake(iter.value().decodeTask))
+                delete iter.value().decodeTask;
+        }
+        else if(source)
+            source->cancel(iter.key());
+        iter = m_tileLoading.erase(iter);
+    }
+    m_loadingCount.storeRelease(m_tileLoading.size());
+    // the warmup reads from the old source are counted as done, the rest is read from the new one
+    QSet<TileSubscriber*> warmups;
+    for(auto iter = m_warmLoading.begin(); iter != m_warmLoading.end();) {
+        if(iter.key().type == type) {
+            if(source)
+                source->cancel(iter.key());
+            auto &warmup = iter.value()->warmup;
+            --warmup.loading;
+            ++warmup.done;
+            warmups.insert(iter.value());
+            iter = m_warmLoading.erase(iter);
+        }
+        else
+            ++iter;
+    }
+    // all cache tiers of the type
+    removeDataCache(type);
+    QVector<quint64> keys;
+    m_tileCache.forEach([&keys, type](quint64 key, TileCacheNode *&){
+        if(quint8(key >> 56) == type)
+            keys.append(key);
+    });
+    for(auto key : keys) {
+        auto node = m_tileCache.take(key);
+        m_tileCacheCost -= node->cost();
+        releaseCacheNode(node);
     }
-    sets.insert(tileSpec);
+    for(auto iter = m_pinnedCache.begin(); iter != m_pinnedCache.end();) {
+        if(iter.key().type == type) {
+            m_pinnedBytes -= iter.value()->bytes;
+            releaseCacheNode(iter.value());
+            iter = m_pinnedCache.erase(iter);
+        }
+        else
+            ++iter;
+    }
+    updateCacheCost();
+    // the view tiles are walked again as if they had just entered the view
+    for(auto sub : m_subscribers) {
+        const auto showedSet = sub->tileShowedSet;
+        for(const auto &tile : showedSet) {
+            if(tile.type == type)
+                hideItem(*sub, tile);
+        }
+        if(sub->tileView.type != type)
+            continue;
+        const TileView view = sub->tileView;
+        sub->tileView = TileView();
+        sub->tileRefs.clear();
+        sub->tileToFetch.clear();
+        updateView(*sub, view);
+    }
+    for(auto sub : warmups) {
+        continueWarmup(*sub);
+    }
+    scheduleRefresh();
+}
+
+/// \note 刚放入的瓦片带有访问标记，CLOCK表针扫过一圈之前不会被淘汰
+void GraphicsMapThread::updateCacheCost()
+{
+    const auto maxCost = qMax<qint64>(0, m_cacheMaxBytes.loadAcquire() - m_pinnedBytes);
+    while(m_tileCacheCost > maxCost && !m_tileCache.isEmpty()) {
+        auto node = m_tileCache.take(m_tileCache.evictCandidate());
+        m_tileCacheCost -= node->cost();
+        releaseCacheNode(node);
+    }
+}
+
+/// 指数滑动平均，与TileSource::latency()相同
+void GraphicsMapThread::reportDecodeLatency(qint64 usec)
+{
+    auto latency = m_decodeLatency.loadAcquire();
+    m_decodeLatency.storeRelease(latency ? (latency * 7 + usec) / 8 : usec);
+}
+
+/// \details 共享图片的内存计入缓存占用和可淘汰开销一次，共享它的节点本身只计最小开销，
+/// 最后一个节点被删除时扣除。分辨率更高的解码结果替换共享图片，已有节点保留原来的图片直到被替换
+/// \note 摘要相同但压缩数据不同(摘要碰撞)时不共享，节点保留自己的图片
+void GraphicsMapThread::shareImage(TileCacheNode *node, quint64 digest, const QByteArray &data)
+{
+    auto &shared = m_sharedImages[digest];
+    if(shared.refs > 0 && shared.data != data)
+        return;
+    shared.data = data;
+    const bool larger = shared.refs == 0
+            || (!isFill(shared.image) && (isFill(node->image) || node->image.width() > shared.image.width()));
+    if(larger) {
+        const qint64 bytes = node->image.sizeInBytes();
+        const qint64 delta = bytes - shared.bytes;
+        shared.image = node->image;
+        shared.bytes = bytes;
+        m_tileCacheCost += delta;
+        auto cacheBytes = m_cacheBytes.fetchAndAddRelaxed(delta) + delta;
+        if(cacheBytes > m_cachePeakBytes.loadAcquire())
+            m_cachePeakBytes.storeRelease(cacheBytes);
+    }
+    else {
+        node->image = shared.image;
+    }
+    ++shared.refs;
+    node->digest = digest;
+}
 
-    if(!tileCacheItem->value && tileSpec.zoom != 0)
-        createAscendingTileCache(tileSpec.rise(), sets);
+void GraphicsMapThread::releaseCacheNode(TileCacheNode *node)
+{
+    if(node->digest)
+        releaseSharedImage(node->digest);
+    delete node;
+}
+
+/// \note 节点仍引用原来的图片数据(隐式共享)，只是内存统计转到节点上
+void GraphicsMapThread::unshareImage(TileCacheNode *node)
+{
+    if(!node->digest)
+        return;
+    releaseSharedImage(node->digest);
+    node->digest = 0;
+    node->bytes = node->image.sizeInBytes();
+    auto cacheBytes = m_cacheBytes.fetchAndAddRelaxed(node->bytes) + node->bytes;
+    if(cacheBytes > m_cachePeakBytes.loadAcquire())
+        m_cachePeakBytes.storeRelease(cacheBytes);
+}
+
+void GraphicsMapThread::releaseSharedImage(quint64 digest)
+{
+    auto iter = m_sharedImages.find(digest);
+    if(iter != m_sharedImages.end() && --iter.value().refs <= 0) {
+        m_tileCacheCost -= iter.value().bytes;
+        m_cacheBytes.fetchAndSubRelaxed(iter.value().bytes);
+        m_sharedImages.erase(iter);
+    }
 }
@@ -2,23 +2,36 @@
 #define GRAPHICSMAP_H
 
 #include "GraphicsMapLib_global.h"
+#include "tiletable.h"
 #include <QWidget>
 #include <QGraphicsView>
 #include <QWheelEvent>
-#include <QCache>
 #include <QGeoCoordinate>
+#include <QGeoRectangle>
 #include <QTimer>
+#include <QThreadPool>
+#include <QQueue>
+#include <QAtomicInteger>
+#include <QSharedPointer>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <limits>
+#include <functional>
 
 class GraphicsMapThread;
+class TileSource;
+class SharedTileCache;
 /*!
  * \brief 基于Graphics View的地图
  * \details 其仅用于显示瓦片地图，要实现地图以外的功能可以继承该类
- * \note 鼠标拖拽地图可通过setDragMode(QGraphicsView::ScrollHandDrag)实现
+ * \note 1.鼠标拖拽地图可通过setDragMode(QGraphicsView::ScrollHandDrag)实现
+ * 2.进程内所有地图共享一个瓦片线程，瓦片缓存、解码线程池和同名数据源只有一份，缓存和解码线程数量的设置对所有地图生效，TMS协议的设置对使用同一瓦片路径的地图生效
  * \bug QGraphicsView::centerOn函数会造成1个像素的抖动问题，参见源码https://github.com/qt/qtbase/blob/5.12.8/src/widgets/graphicsview/qgraphicsview.cpp 1936行
  */
 class GRAPHICSMAPLIB_EXPORT GraphicsMap : public QGraphicsView
 {
     Q_OBJECT
+    friend class GraphicsMapThread;
 
 public:
     /// 瓦片参数描述结构体
@@ -30,14 +43,16 @@ public:
         inline TileSpec rise() const {
             return GraphicsMap::TileSpec({type, static_cast<quint8>(zoom-1), x/2, y/2});
         }
+        /// 按类型、层级、Morton编码排序
         inline bool operator< (const TileSpec &rhs) const {
-            return this->toLong() < rhs.toLong();
+            return this->toKey() < rhs.toKey();
         };
         inline bool operator== (const TileSpec &rhs) const {
-            return this->toLong() == rhs.toLong();
+            return type == rhs.type && zoom == rhs.zoom && x == rhs.x && y == rhs.y;
         };
-        inline qlonglong toLong() const {
-            return (qlonglong(type)<<52) | (qlonglong(zoom)<< 44) | (qlonglong(x)<< 22) | y;
+        /// 瓦片表的键，参见TileTable
+        inline quint64 toKey() const {
+            return TileTable<int>::key(type, zoom, x, y);
         };
     };
     /// 显示瓦片区域
@@ -46,17 +61,64 @@ public:
         qreal   rotation;   ///< 旋转角度
         quint8  horCount;   ///< 水平方向瓦片数量
         quint8  verCount;   ///< 垂直方向瓦片数量
+        QPointF focus;      ///< 优先加载的焦点(该层级的瓦片坐标)，视口中心或滚轮缩放时的鼠标位置(不参与比较)
+        quint8  prefetchZoom = 0;   ///< 预取层级
+        QRect   prefetchRect;       ///< 预取区域(预取层级的瓦片坐标)，为空代表不预取
+        quint16 tileSize = 256;     ///< 该层级瓦片在屏幕上的像素大小(向上取整到32的倍数，不超过瓦片原始大小)，瓦片按该大小解码
         inline bool operator== (const TileRegion &rhs) const {
-            return origin == rhs.origin && rotation == rhs.rotation && horCount == rhs.horCount && verCount == rhs.verCount;
+            return origin == rhs.origin && rotation == rhs.rotation && horCount == rhs.horCount && verCount == rhs.verCount
+                    && prefetchZoom == rhs.prefetchZoom && prefetchRect == rhs.prefetchRect && tileSize == rhs.tileSize;
         }
     };
+    /// 一次刷新中需要添加和移除的瓦片，由瓦片线程整批发送到GUI线程
+    struct TileDelta {
+        QVector<QPair<TileSpec, QImage>> added;   ///< 新显示的瓦片及其图片，1x1的图片代表纯色瓦片
+        QVector<TileSpec>                removed; ///< 不再显示的瓦片
+        inline bool isEmpty() const {
+            return added.isEmpty() && removed.isEmpty();
+        }
+    };
+    /// 瓦片缓存层
+    enum TileCacheTier {
+        DecodedTier,        ///< 解码后的图片
+        CompressedTier,     ///< 从数据源读取的原始数据(jpg/png)，再次显示时只需解码，无需读取
+        SharedTier,         ///< 跨进程共享的解码图片(参见setTileSharedCache)，内存为整个共享内存，命中统计只计本进程
+    };
+    /// 瓦片缓存内存统计
+    struct TileCacheStats {
+        qint64 bytes;       ///< 当前占用内存(字节)，包含常驻层级瓦片
+        qint64 peakBytes;   ///< 峰值占用内存(字节)
+        qint64 maxBytes;    ///< 内存上限(字节)
+        qint64 hits;        ///< 命中次数
+        qint64 misses;      ///< 未命中次数
+    };
+    /// 运行统计，参见stats()
+    struct MapStats {
+        qreal  frameP50 = 0;        ///< 最近若干帧绘制耗时的50分位(毫秒)
+        qreal  frameP95 = 0;        ///< 95分位(毫秒)
+        qreal  frameP99 = 0;        ///< 99分位(毫秒)
+        int    frames = 0;          ///< 参与统计的帧数
+        int    itemsPainted = 0;    ///< 最近一帧重绘区域内的图元数量，只在启用统计信号或叠加层时计算
+        int    tilesPainted = 0;    ///< 最近一帧绘制的瓦片数量
+        int    visibleTiles = 0;    ///< 已上传显示的瓦片数量
+        qint64 pixmapBytes = 0;     ///< 已上传瓦片占用的内存(字节)
+        int    pendingUploads = 0;  ///< 等待上传的瓦片数量
+        int    pendingLoads = 0;    ///< 正在读取或解码的瓦片数量(所有地图共享)
+        qint64 decodeLatency = 0;   ///< 平均解码耗时(微秒)
+        TileCacheStats decodedCache = {};     ///< 解码图片缓存
+        TileCacheStats compressedCache = {};  ///< 压缩数据缓存
+        TileCacheStats sharedCache = {};      ///< 跨进程共享缓存
+    };
 
     GraphicsMap(QWidget *parent = nullptr);
     ~GraphicsMap();
-    /// 设置更新帧率\param fps 地图定时刷新的帧率，0或者负值可切换为按需更新
+    /// 设置更新帧率\param fps 最高帧率，图元和瓦片的变化区域累积到下一帧一起重绘，没有变化时不重绘；0或者负值可切换为按需更新
     void setFrameRate(int fps);
-    /// 设置瓦片路径
+    /// 设置瓦片路径，可以是瓦片目录、单文件瓦片包(参见TileArchive和TilePacker工具)或者网络瓦片服务的URL模板(参见HttpTileSource)
+    /// \note 瓦片目录将在后台读取或建立瓦片可用性索引(瓦片目录下的tiles.idx)，索引就绪后缺失瓦片不再访问磁盘，瓦片目录内容变化后索引在后台重新建立
     void setTilePath(const QString &path);
+    /// 设置自定义瓦片数据源，地图将获取其所有权，同名的数据源被替换后所有地图都使用新的数据源 \see TileSource
+    void setTileSource(TileSource *source);
     /// 设置缩放等级
     void setZoomLevel(float zoom);
     const float &zoomLevel() const;
@@ -66,10 +128,48 @@ public:
     void setRotation(const qreal &degree);
     /// 获取当前朝向
     const qreal &rotation() const;
-    /// 设置瓦片缓存数量 默认1000张瓦片
+    /// 设置瓦片缓存数量 按每张瓦片256*256*4字节换算为内存上限，参见setTileCacheSize
     void setTileCacheCount(const int &count);
+    /// 设置瓦片缓存内存上限(字节) 默认256MB，按解码后的实际字节数计算
+    void setTileCacheSize(const qint64 &bytes);
+    /// 设置常驻缓存的最大层级 默认3，0~zoom级瓦片不会被淘汰(上层瓦片是缺省瓦片的显示依据)，-1代表不常驻
+    void setTilePinnedZoom(const int &zoom);
+    /// 设置压缩数据缓存内存上限(字节) 默认64MB，0代表不缓存
+    void setTileDataCacheSize(const qint64 &bytes);
+    /// 获取瓦片缓存内存统计 \param tier 缓存层
+    TileCacheStats tileCacheStats(TileCacheTier tier = DecodedTier) const;
+    /// 获取运行统计快照：帧耗时分位数、绘制数量、各缓存层命中率和内存、解码耗时、待处理的瓦片
+    MapStats stats() const;
+    /// 设置统计信号的发送间隔(毫秒) 默认0，0代表不发送 \see statsUpdated
+    void setStatsInterval(int msec);
+    /// 设置是否在视口左上角叠加显示运行统计
+    void setStatsOverlayVisible(bool visible);
+    /// 启用跨进程共享的瓦片缓存，同一主机上使用相同名称的进程共享解码后的瓦片，一个进程解码后其他进程无需再次读取和解码
+    /// \param key 共享内存名称，空代表不使用 \param bytes 共享内存大小，连接已有的共享内存时使用其原有大小 \see SharedTileCache
+    void setTileSharedCache(const QString &key, const qint64 &bytes = qint64(256) * 1024 * 1024);
+    /// 设置瓦片解码线程数量 默认为CPU核心数
+    void setTileDecodeThreadCount(const int &count);
+    /// 设置每帧用于上传瓦片到场景的时间预算(毫秒) 默认4ms，超出预算的瓦片将在下一帧继续上传
+    void setTileUploadBudget(const int &msec);
+    /// 设置预取时间(毫秒) 默认300ms，根据平移速度和缩放方向预取视口在该时间后到达的瓦片，0代表不预取
+    void setTilePrefetchTime(const int &msec);
     /// 设置TMS瓦片协议 默认XYZ协议（在TMS协议中，y=0的瓦片是最南边的瓦片，而在XYZ模式(OGC WMTS也使用)中，y=0的瓦片是最北边的瓦片)
+    /// \note 作用于当前和之后设置的瓦片路径，不影响其他路径的数据源；通过setTileSource设置的数据源请直接调用TileSource::setTMSMode
     void setTMSMode(const bool &on);
+    /// 预热区域：以最低优先级读取区域内minZoom~maxZoom层级的瓦片，放入压缩数据缓存(同时进入系统页缓存)，之后首次浏览该区域无需访问磁盘
+    /// \note 读取的数据量不超过压缩数据缓存上限，新的预热请求会取消尚未完成的预热 \see prefetchProgress prefetchFinished
+    void prefetchRegion(const QGeoRectangle &rect, int minZoom, int maxZoom);
+    /// 取消区域预热
+    void cancelPrefetch();
+    /// 离屏渲染区域：瓦片和场景中的图元按层级和朝向绘制到图片，无需显示窗口(可在QT_QPA_PLATFORM=offscreen下使用)
+    /// \param zoom 层级，图片大小为区域在该层级下的像素大小 \param rotation 朝向，图片内容绕区域中心旋转 \return 失败时为空图片
+    /// \note 在调用线程中同步并行读取瓦片，不经过瓦片缓存，大尺寸导出请使用renderStrips
+    QImage renderImage(const QGeoRectangle &rect, float zoom, qreal rotation = 0);
+    /// 按条离屏渲染，每次只为一条读取瓦片和分配图片，参见renderImage
+    /// \param stripHeight 每条的高度(像素) \param sink 接收每条图片及其在整幅图片中的y坐标，返回false时中止渲染
+    /// \return 是否全部渲染完成
+    bool renderStrips(const QGeoRectangle &rect, float zoom, qreal rotation, int stripHeight,
+                      const std::function<bool(const QImage &strip, int y)> &sink);
     using QGraphicsView::centerOn;
     /// 居中
     void centerOn(const QGeoCoordinate &coord);
@@ -83,7 +183,7 @@ public:
     static QGeoCoordinate toCoordinate(const QPointF &point);
     /// 获取经纬度对应的场景坐标
     static QPointF toScene(const QGeoCoordinate &coord);
-    /// 通过资源路径，获取唯一对应的资源类型
+    /// 通过资源路径，获取唯一对应的资源类型(线程安全)
     static quint8 mapType(const QString &path);
 
 
@@ -91,26 +191,91 @@ signals:
     void zoomChanged(const float &zoom);
     void tileRequested(const TileRegion &region);
     void pathRequested(const QString &path);
+    /// 区域预热进度 \param done 已处理的瓦片数量 \param total 瓦片总数
+    void prefetchProgress(qint64 done, qint64 total);
+    /// 按统计间隔发送的运行统计 \see setStatsInterval
+    void statsUpdated(const GraphicsMap::MapStats &stats);
+    /// 区域预热结束 \param completed 是否全部完成，被取消或达到压缩数据缓存上限时为false
+    void prefetchFinished(bool completed);
 
 protected:
     virtual void resizeEvent(QResizeEvent *event) override; ///< 用于限制地图最小缩放等级
+    virtual void drawBackground(QPainter *painter, const QRectF &rect) override; ///< 按层级从低到高绘制瓦片
+    virtual void scrollContentsBy(int dx, int dy) override; ///< 限制帧率时平移在下一帧重绘
+    virtual void paintEvent(QPaintEvent *event) override;   ///< 统计帧耗时
+    virtual void drawForeground(QPainter *painter, const QRectF &rect) override; ///< 绘制统计叠加层
 
 private:
     void init();
     void updateTile();
+    /// 整批应用瓦片线程发送的增删
+    void applyTileDelta(const TileDelta &delta);
+    /// 瓦片线程处理完一次区域请求，继续处理挂起的请求
+    void finishTileRequest();
+    /// 在预算时间内将解码好的瓦片创建为QPixmap
+    void uploadTile();
+    /// 根据视口的平移速度和缩放方向计算预取区域
+    void updatePrefetch(TileRegion &region);
+    /// 累积场景的变化区域，等待下一帧重绘
+    void onSceneChanged(const QList<QRectF> &region);
+    /// 累积视口的重绘区域，距上一帧不足帧间隔时推迟到下一帧
+    void scheduleFrame(const QRegion &region);
+    /// 重绘累积的区域
+    void paintFrame();
+    /// 重绘视口区域，限制帧率时推迟到下一帧
+    void updateRegion(const QRegion &region);
+    /// 按统计间隔和叠加层启停统计定时器
+    void restartStats();
+    /// 定时统计：发送统计信号，刷新叠加层
+    void updateStats();
+    static QRectF tileRect(const TileSpec &tileSpec);
+    /// 区域在该层级下的场景矩形和图片大小
+    static QRectF renderBox(const QGeoRectangle &rect, float zoom, QSize &size);
 
 private:
     static QStringList m_mapTypes; ///< 资源路径类型
 private:
-    GraphicsMapThread    *m_mapThread;
-    QSet<QGraphicsItem*> m_tiles;          ///< 已显示瓦片
+    QSharedPointer<GraphicsMapThread> m_mapThread;  ///< 进程内所有地图共享的瓦片线程
+    /// 已上传的瓦片
+    struct TilePixmap {
+        QPixmap pixmap;     ///< 瓦片图片，纯色瓦片为空
+        QColor  color;      ///< 纯色瓦片的填充颜色
+    };
+    QMap<TileSpec, TilePixmap> m_tiles;    ///< 已显示瓦片，按类型和层级排序，即绘制顺序
     quint8               m_type;           ///< 瓦片资源类型
-    QTimer               m_updateTimer;    ///< 更新定时器
+    bool                 m_bTMS;           ///< 瓦片路径是否为TMS协议
+    //
+    int           m_frameInterval;  ///< 帧间隔(毫秒)，0代表按需更新
+    QRegion       m_dirtyRegion;    ///< 等待下一帧重绘的视口区域
+    QTimer        m_frameTimer;     ///< 下一帧定时器，没有变化时不启动
+    QElapsedTimer m_frameClock;     ///< 上一帧开始的计时
+    //
+    QVector<float> m_frameTimes;    ///< 最近若干帧的绘制耗时(毫秒)，循环写入
+    int            m_frameIndex;    ///< 下一帧耗时的写入位置
+    int            m_itemsPainted;  ///< 最近一帧重绘区域内的图元数量
+    int            m_tilesPainted;  ///< 最近一帧绘制的瓦片数量
+    int            m_statsInterval; ///< 统计信号的发送间隔(毫秒)
+    bool           m_statsOverlay;  ///< 是否显示统计叠加层
+    QTimer         m_statsTimer;    ///< 统计定时器
+    QString        m_statsText;     ///< 叠加层文字
+    QRect          m_statsRect;     ///< 叠加层在视口中的区域
+    //
+    QQueue<TileSpec>        m_uploadQueue;   ///< 待上传瓦片队列(可能包含已取消的瓦片)
+    QHash<TileSpec, QImage> m_uploadImages;  ///< 待上传瓦片图片
+    QTimer                  m_uploadTimer;   ///< 瓦片上传定时器
+    int                     m_uploadBudget;  ///< 每帧上传瓦片的时间预算(毫秒)
     //
     TileRegion m_tileRegion;    ///< 显示瓦片区域
     //
     bool  m_isloading;          ///< 正在加载地图
     bool  m_hasPendingLoad;     ///< 是否有挂起的加载请求
+    //
+    QElapsedTimer m_motionTimer;    ///< 视口运动采样计时
+    QPointF m_lastCenter;           ///< 上一次采样的视口中心(场景坐标)
+    float   m_lastZoom;             ///< 上一次采样的层级
+    QPointF m_panVelocity;          ///< 平移速度(场景坐标/毫秒)
+    qreal   m_zoomVelocity;         ///< 缩放速度(层级/毫秒)
+    int     m_prefetchTime;         ///< 预取时间(毫秒)
     float m_zoom;               ///< 当前层级
     float m_minZoom;            ///< 最小缩放层级，刚好适应窗口大小
     float m_maxZoom;            ///< 最大缩放层级，防止无限放大
@@ -119,66 +284,271 @@ private:
 };
 Q_DECLARE_METATYPE(GraphicsMap::TileSpec);
 Q_DECLARE_METATYPE(GraphicsMap::TileRegion);
+Q_DECLARE_METATYPE(GraphicsMap::TileDelta);
+Q_DECLARE_METATYPE(GraphicsMap::MapStats);
 
 inline uint qHash(const GraphicsMap::TileSpec &key, uint seed)
 {
-    qlonglong keyVal = (qlonglong(key.zoom)<<48) + (qlonglong(key.x)<< 24) + key.y;
-    return qHash(keyVal, seed);
+    return qHash(key.toKey(), seed);
 }
 
 /*!
  * \brief 瓦片地图管理线程
- * \details 负责加载瓦片、卸载瓦片
+ * \details 负责加载瓦片、卸载瓦片。瓦片数据由TileSource异步读取，在解码线程池中解码后放入缓存，
+ * 正在加载的瓦片暂时由已缓存的上层瓦片代替显示。
+ * 进程内所有地图共享一个实例(参见instance())，缓存、解码线程池、数据源和加载任务只有一份，
+ * 每个地图作为订阅者维护自己的视图区域、瓦片引用和显示集合
  */
 class GraphicsMapThread : public QObject
 {
     Q_OBJECT
 
-    /// 瓦片缓存节点，配合QCache实现缓存机制
+    /// 瓦片缓存节点，配合TileTable实现缓存机制
     struct TileCacheNode {
         GraphicsMap::TileSpec tileSpec;
-        QGraphicsItem *value = nullptr;
+        QImage image;     ///< 解码后的瓦片图片，为空代表瓦片不存在，纯色瓦片为1x1的填充颜色
+        qint64 bytes = 0; ///< 图片占用内存，共享的图片由m_sharedImages统计
+        quint64 digest = 0; ///< 压缩数据的摘要，非0代表图片与内容相同的瓦片共享
+        QAtomicInteger<qint64> *usage = nullptr; ///< 缓存内存统计，节点析构(被淘汰)时扣除
         ~TileCacheNode();
+        /// 缓存开销，不存在的瓦片也记1KB，避免无限缓存空节点
+        inline qint64 cost() const {
+            return qMax<qint64>(1024, bytes);
+        }
+        /// 图片分辨率，纯色瓦片在任何尺寸下都是完整的
+        inline int resolution() const {
+            return isFill(image) ? std::numeric_limits<int>::max() : image.width();
+        }
+    };
+    /// 内容相同的瓦片共享的图片
+    struct SharedImage {
+        QImage image;
+        QByteArray data;    ///< 压缩数据，摘要相同时再比较内容，避免误用其他瓦片的图片
+        qint64 bytes = 0;   ///< 图片占用内存，只统计一次
+        int    refs = 0;    ///< 共享该图片的缓存节点数量
+    };
+    class TileDecodeTask;
+    /// 正在加载的瓦片
+    struct TileLoad {
+        quint32 generation = 0;     ///< 最近一次需要该瓦片的区域编号(参见m_generation)
+        TileDecodeTask *decodeTask = nullptr;  ///< 解码任务，为空代表正在读取
+        int priority = 0;           ///< 读取和解码的优先级
+        int size = 0;               ///< 解码尺寸
+        quint64 digest = 0;         ///< 压缩数据的摘要，读取完成后计算
+        QByteArray data;            ///< 压缩数据，解码完成后与共享图片的数据比较
+    };
+    /// 视图区域内的瓦片，按行记录瓦片X编号范围
+    struct TileView {
+        quint8 type = 0;
+        quint8 zoom = 0;
+        int top = 0;                ///< 第一行的瓦片Y编号
+        QVector<QPoint> spans;      ///< 每行的瓦片X编号范围[x(), y()]，x() > y()代表空行
+        inline QPoint span(int row) const {
+            return (row < top || row >= top + spans.size()) ? QPoint(0, -1) : spans.at(row - top);
+        }
+        inline bool contains(const GraphicsMap::TileSpec &spec) const {
+            if(spec.type != type || spec.zoom != zoom)
+                return false;
+            const auto range = span(int(spec.y));
+            return int(spec.x) >= range.x() && int(spec.x) <= range.y();
+        }
+    };
+    /// 已尝试显示的瓦片
+    struct TileRef {
+        int  refs = 0;          ///< 向上查找经过该瓦片的视图瓦片数量
+        bool solid = false;     ///< 是否有图片，视图瓦片向上查找到此为止
+    };
+    /// 区域预热，按层级逐行读取瓦片
+    struct TileWarmup {
+        quint8 type = 0;
+        QVector<QPair<quint8, QRect>> levels;   ///< 各层级的瓦片范围，为空代表没有预热
+        int     level = 0;          ///< 当前层级
+        QPoint  next;               ///< 当前层级的下一个瓦片
+        qint64  total = 0;          ///< 瓦片总数
+        qint64  done = 0;           ///< 已处理的瓦片数量
+        qint64  bytes = 0;          ///< 已读取的数据量
+        int     loading = 0;        ///< 正在读取的瓦片数量
+        QElapsedTimer reportTimer;  ///< 进度报告的间隔计时
+    };
+    /// 订阅瓦片的地图
+    struct TileSubscriber {
+        GraphicsMap                   *map = nullptr;
+        GraphicsMap::TileRegion        tileRegion;      ///< 请求的瓦片区域
+        TileView                       tileView;        ///< 当前区域内的瓦片
+        QSet<GraphicsMap::TileSpec>    tilePrefetchSet; ///< 预取区域内的瓦片编号集合(不包含当前区域)
+        TileTable<TileRef>             tileRefs;        ///< 已尝试显示瓦片及其引用(存在依赖关系的瓦片，实际上只有有图片的才显示)
+        QVector<GraphicsMap::TileSpec> tileToFetch;     ///< 待读取的瓦片
+        QSet<GraphicsMap::TileSpec>    tileShowedSet;   ///< 实际显示瓦片编号集合
+        GraphicsMap::TileDelta         tileDelta;       ///< 尚未发送的瓦片增删
+        TileWarmup                     warmup;          ///< 区域预热
     };
 
 public:
     GraphicsMapThread();
     ~GraphicsMapThread();
 
+    /// 获取进程内共享的瓦片线程，最后一个使用者释放后销毁 \note 只能在GUI线程中调用
+    static QSharedPointer<GraphicsMapThread> instance();
+    /// 地图订阅瓦片，之后通过requestTile请求该地图的瓦片区域
+    void subscribe(GraphicsMap *map);
+    /// 取消订阅
+    void unsubscribe(GraphicsMap *map);
+    /// 获取瓦片类型的数据源，不存在时为空 \note 只能在瓦片线程以外调用
+    QSharedPointer<TileSource> tileSource(quint8 type);
+    /// 是否为纯色瓦片的填充图片
+    static inline bool isFill(const QImage &image) {
+        return image.width() == 1 && image.height() == 1;
+    }
+
 
 public slots:
-    /// 请求刷新瓦片区域
-    void requestTile(const GraphicsMap::TileRegion &region);
+    /// 请求刷新地图的瓦片区域
+    void requestTile(GraphicsMap *map, const GraphicsMap::TileRegion &region);
     /// 请求更改瓦片资源来源
     void requestPath(const QString &path);
 
 public:
-    /// 设置瓦片缓存数量 默认1000张瓦片
-    void setTileCacheCount(const int &count);
-    /// 设置TMS瓦片协议 默认XYZ协议（在TMS协议中，y=0的瓦片是最南边的瓦片，而在XYZ模式(OGC WMTS也使用)中，y=0的瓦片是最北边的瓦片)
-    void setTMSMode(const bool &on);
-
-signals:
-    void tileToAdd(QGraphicsItem *tile);
-    void tileToRemove(QGraphicsItem *tile);
-    void requestFinished();
+    /// 预热地图的区域 \param levels 各层级的瓦片范围 \note 需要在瓦片线程中调用
+    void warmupRegion(GraphicsMap *map, quint8 type, const QVector<QPair<quint8, QRect>> &levels);
+    /// 取消地图的区域预热 \note 需要在瓦片线程中调用
+    void cancelWarmup(GraphicsMap *map);
+    /// 请求更改瓦片数据源 \note 需要在瓦片线程中调用
+    void requestSource(const QSharedPointer<TileSource> &source);
+    /// 设置瓦片缓存内存上限(字节)
+    void setTileCacheSize(const qint64 &bytes);
+    /// 设置常驻缓存的最大层级，已缓存的瓦片按新的层级在常驻缓存和可淘汰缓存之间移动
+    void setPinnedZoom(const int &zoom);
+    /// 设置压缩数据缓存内存上限(字节)
+    void setDataCacheSize(const qint64 &bytes);
+    /// 设置跨进程共享缓存，连接失败时不使用
+    void setSharedCache(const QString &key, const qint64 &bytes);
+    /// 获取瓦片缓存内存统计(线程安全)
+    GraphicsMap::TileCacheStats cacheStats(GraphicsMap::TileCacheTier tier) const;
+    /// 平均解码耗时(微秒，线程安全)
+    qint64 decodeLatency() const;
+    /// 正在读取或解码的瓦片数量(线程安全)
+    int loadingCount() const;
+    /// 设置瓦片解码线程数量 默认为CPU核心数
+    void setDecodeThreadCount(const int &count);
+    /// 设置瓦片类型的TMS协议，只影响该类型的数据源，协议改变时该类型的瓦片重新加载 \see GraphicsMap::setTMSMode
+    void setTMSMode(quint8 type, bool on);
 
 private:
-    void showItem(const GraphicsMap::TileSpec &tileSpec);
-    void hideItem(const GraphicsMap::TileSpec &tileSpec);
-    /// 从磁盘加载瓦片文件
-    QGraphicsPixmapItem* loadTileItem(const GraphicsMap::TileSpec &tileSpec);
-    void createAscendingTileCache(const GraphicsMap::TileSpec &tileSpec, QSet<GraphicsMap::TileSpec> &sets);
+    void showItem(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec);
+    void hideItem(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec);
+    /// 比较新旧视图，只处理进入和离开视图的瓦片
+    void updateView(TileSubscriber &sub, const TileView &view);
+    /// 瓦片进入视图，从该瓦片开始逐层向上增加引用，直到遇到有图片的瓦片，未缓存的瓦片加入读取列表
+    void addViewTile(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec);
+    /// 瓦片离开视图，沿进入时的路径减少引用
+    void removeViewTile(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec);
+    /// 减少瓦片引用，不再被引用的瓦片隐藏 \param key 瓦片的键，逐层向上时由TileTable::parentKey得到 \return 是否有图片(向上查找到此为止)
+    bool releaseTile(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec, quint64 key, int count);
+    /// 瓦片加载出图片后，经过它的视图瓦片不再需要更上层的瓦片
+    void solidifyTile(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec);
+    /// 取消不再需要的加载，按新的焦点调整仍需要的加载的优先级
+    void updateLoading();
+    /// 请求所有订阅者读取列表中的瓦片，并发送瓦片增删
+    void refreshTile();
+    /// 向地图发送累积的瓦片增删
+    void flushDelta(TileSubscriber &sub);
+    /// 通知地图区域请求已处理
+    void finishRequest(TileSubscriber &sub);
+    /// 合并多个瓦片的加载完成事件，在下一次事件循环中统一刷新
+    void scheduleRefresh();
+    /// 向数据源请求读取瓦片 \param size 解码尺寸
+    void fetchTile(const GraphicsMap::TileSpec &tileSpec, int priority, int size);
+    /// 在缓存的空余空间内预取视口即将到达的瓦片
+    void prefetchTile(TileSubscriber &sub);
+    /// 在并发数量和数据量限制内继续读取预热瓦片，全部处理完成后结束预热
+    void continueWarmup(TileSubscriber &sub);
+    /// 预热的下一个瓦片 \return 是否还有瓦片
+    bool nextWarmupTile(TileWarmup &warmup, GraphicsMap::TileSpec &tileSpec);
+    /// 放弃正在读取的预热瓦片
+    void dropWarmup(TileSubscriber &sub);
+    /// 结束预热并通知地图
+    void finishWarmup(TileSubscriber &sub, bool completed);
+    /// 向地图报告预热进度
+    void reportWarmup(TileSubscriber &sub);
+    /// 瓦片加载优先级，上层瓦片优先，同一层级离焦点越近越优先
+    int tilePriority(const TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec) const;
+    /// 需要该瓦片的订阅者中的最高优先级，预取按预取优先级计算，没有订阅者需要时返回UNWANTED_PRIORITY
+    int loadPriority(const GraphicsMap::TileSpec &tileSpec) const;
+    /// 瓦片的解码尺寸，作为缺省显示的上层瓦片按原始大小解码
+    int tileDecodeSize(const TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec) const;
+    /// 是否需要读取或解码：未缓存，或者缓存的图片小于解码尺寸
+    bool needsDecode(const TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec);
+    /// 是否超出数据源的最大层级，这些瓦片由缓存的最大层级瓦片放大生成
+    bool isOverzoom(const GraphicsMap::TileSpec &tileSpec) const;
+    /// 最大层级瓦片加载完成后，生成视图中由它放大的瓦片
+    void refreshOverzoom(TileSubscriber &sub, const GraphicsMap::TileSpec &tileSpec);
+    /// 取消尚未开始读取或解码的瓦片 \return 是否取消成功
+    bool cancelTile(const GraphicsMap::TileSpec &tileSpec, const TileLoad &load);
+    /// 数据源读取完成，提交到解码线程池
+    void onTileFetched(const GraphicsMap::TileSpec &tileSpec, const QByteArray &data);
+    /// 数据源读取失败，不放入缓存，稍后重新读取仍需要的瓦片
+    void onTileFailed(const GraphicsMap::TileSpec &tileSpec);
+    /// 解码瓦片数据，内容相同且已解码的瓦片直接共享图片
+    void decodeTile(const GraphicsMap::TileSpec &tileSpec, const QByteArray &data);
+    /// 瓦片解码完成(或确定不存在)，放入缓存
+    void onTileDecoded(const GraphicsMap::TileSpec &tileSpec, const QImage &image, TileDecodeTask *task = nullptr);
+    /// 查找缓存节点(包括常驻缓存)
+    TileCacheNode *cacheNode(const GraphicsMap::TileSpec &tileSpec);
+    /// 放入缓存，低层级瓦片放入常驻缓存
+    void insertCacheNode(TileCacheNode *node);
+    /// 按内存上限和常驻缓存占用淘汰超出容量的缓存
+    void updateCacheCost();
+    /// 登记共享图片，已有内容相同的图片时节点改用该图片
+    void shareImage(TileCacheNode *node, quint64 digest, const QByteArray &data);
+    /// 记录一次解码耗时(微秒) \note 在解码线程中调用
+    void reportDecodeLatency(qint64 usec);
+    /// 删除缓存节点，释放其共享的图片
+    void releaseCacheNode(TileCacheNode *node);
+    /// 节点不再共享图片，图片内存改由节点自己统计
+    void unshareImage(TileCacheNode *node);
+    /// 减少共享图片的引用，最后一个引用释放时扣除其内存
+    void releaseSharedImage(quint64 digest);
+    /// 放入压缩数据缓存
+    void insertDataCache(const GraphicsMap::TileSpec &tileSpec, const QByteArray &data);
+    /// 按内存上限淘汰压缩数据缓存
+    void updateDataCacheCost();
+    /// 移除某一类型的压缩数据缓存
+    void removeDataCache(quint8 type);
+    /// 数据源或TMS协议改变后重置某一类型的瓦片：取消加载，清除各级缓存，视图中的瓦片重新加载
+    void resetTiles(quint8 type);
 
 private:
-    QCache<GraphicsMap::TileSpec, TileCacheNode> m_tileCache; ///<已加载瓦片缓存
-    QSet<GraphicsMap::TileSpec>    m_tileTriedToShowdSet;     ///<已尝试显示瓦片编号集合(上一次调用过showItem的所有瓦片，存在依赖关系的瓦片，实际上只有顶层才显示)
-    QSet<GraphicsMap::TileSpec>    m_tileShowedSet;           ///<实际显示瓦片编号集合
+    TileTable<TileCacheNode*> m_tileCache;     ///<已加载瓦片缓存，按CLOCK算法淘汰
+    qint64                  m_tileCacheCost;   ///< 可淘汰缓存的开销
+    QHash<GraphicsMap::TileSpec, TileCacheNode*> m_pinnedCache; ///<常驻瓦片缓存，不参与淘汰
+    QAtomicInteger<qint64>  m_cacheMaxBytes;   ///< 缓存内存上限，只在瓦片线程中修改
+    qint64                  m_pinnedBytes;     ///< 常驻缓存占用内存
+    int                     m_pinnedZoom;      ///< 常驻缓存的最大层级
+    QAtomicInteger<qint64>  m_cacheBytes;      ///< 缓存占用内存
+    QAtomicInteger<qint64>  m_cachePeakBytes;  ///< 缓存峰值占用内存
+    QAtomicInteger<qint64>  m_cacheHits;       ///< 缓存命中次数
+    QAtomicInteger<qint64>  m_cacheMisses;     ///< 缓存未命中次数
+    QHash<quint64, SharedImage> m_sharedImages; ///< 按压缩数据摘要共享的图片
+    QSharedPointer<SharedTileCache> m_sharedCache; ///< 跨进程共享缓存，为空代表不使用
+    mutable QMutex          m_sharedCacheMutex;    ///< 保护其他线程(统计)读取m_sharedCache，瓦片线程自己读取时无需加锁
+    TileTable<QByteArray>   m_dataCache;       ///< 压缩数据缓存，按CLOCK算法淘汰
+    QAtomicInteger<qint64>  m_dataCacheMaxBytes;   ///< 压缩数据缓存内存上限，只在瓦片线程中修改
+    QAtomicInteger<qint64>  m_dataCacheBytes;      ///< 压缩数据缓存占用内存
+    QAtomicInteger<qint64>  m_dataCachePeakBytes;  ///< 压缩数据缓存峰值占用内存
+    QAtomicInteger<qint64>  m_dataCacheHits;       ///< 压缩数据缓存命中次数
+    QAtomicInteger<qint64>  m_dataCacheMisses;     ///< 压缩数据缓存未命中次数
+    QHash<GraphicsMap*, TileSubscriber*>   m_subscribers;     ///<订阅瓦片的地图
+    QHash<GraphicsMap::TileSpec, TileLoad> m_tileLoading;     ///<正在读取或解码的瓦片，由所有订阅者共享
+    QHash<GraphicsMap::TileSpec, TileSubscriber*> m_warmLoading; ///<正在读取的预热瓦片及发起预热的订阅者
+    quint32                        m_generation;              ///<区域编号，每次请求递增，用于识别过期的加载任务
+    bool                           m_refreshPending;          ///<是否已安排刷新
+    QAtomicInt                     m_loadingCount;            ///<正在加载的瓦片数量，供其他线程统计
+    QAtomicInteger<qint64>         m_decodeLatency;           ///<平均解码耗时(微秒)
     //
-    GraphicsMap::TileRegion m_tileRegion;    ///< 请求的瓦片区域
+    QHash<quint8, QSharedPointer<TileSource>> m_sources;  ///< 各瓦片类型的数据源(保留已使用过的数据源，切换回来时无需重建索引)
+    QSet<quint8>     m_tmsTypes;      ///< 使用TMS协议的瓦片类型，按路径创建数据源时使用
     //
-    QString          m_path;
-    bool             m_bTMS;
+    QThreadPool      m_decodePool;    ///< 瓦片解码线程池
 };
 
 #endif // GRAPHICSMAP_H
@@ -0,0 +1,201 @@
+﻿#include "maptrace.h"
+
+#ifdef GRAPHICSMAPLIB_TRACE
+#include <QElapsedTimer>
+#include <QThread>
+#include <QMutex>
+#include <QHash>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QCoreApplication>
+#include <atomic>
+
+#define TRACE_CAPACITY (1 << 16)    ///< 环形缓冲区的事件数量，2的幂
+#define TRACE_BUSY     (~quint64(0)) ///< 事件正在写入时的序号
+
+namespace {
+
+/// 环形缓冲区中的事件，通过序号锁读写：序号为0代表空，TRACE_BUSY代表正在写入，写完后为事件编号加1
+/// \note 字段均为原子变量，读写线程并发访问时不构成数据竞争
+struct TraceEvent {
+    QAtomicInteger<quint64> seq;
+    QAtomicPointer<const char> name;
+    QAtomicInteger<quint64> tid;
+    QAtomicInteger<qint64>  begin;
+    QAtomicInteger<qint64>  duration;
+};
+
+struct TraceBuffer {
+    QElapsedTimer clock;
+    QAtomicInteger<quint64> next;       ///< 下一个事件编号
+    TraceEvent events[TRACE_CAPACITY];
+    QMutex mutex;                       ///< 保护threadNames
+    QHash<quint64, QString> threadNames;
+    TraceBuffer() : next(0) {
+        clock.start();
+    }
+};
+
+TraceBuffer &buffer()
+{
+    static TraceBuffer *traceBuffer = new TraceBuffer;
+    return *traceBuffer;
+}
+
+/// 当前线程编号，第一次记录时登记线程名称
+quint64 threadId()
+{
+    static thread_local quint64 tid = 0;
+    if(!tid) {
+        tid = quint64(reinterpret_cast<quintptr>(QThread::currentThreadId()));
+        auto name = QThread::currentThread()->objectName();
+        if(name.isEmpty())
+            name = QString("Thread %1").arg(tid);
+        auto &traceBuffer = buffer();
+        QMutexLocker locker(&traceBuffer.mutex);
+        traceBuffer.threadNames.insert(tid, name);
+    }
+    return tid;
+}
+
+}
+
+MapTrace::Scope::Scope(const char *name) :
+    m_name(name),
+    m_begin(MapTrace::now())
+{
+}
+
+MapTrace::Scope::~Scope()
+{
+    MapTrace::record(m_name, m_begin, MapTrace::now());
+}
+
+bool MapTrace::isAvailable()
+{
+    return true;
+}
+
+void MapTrace::record(const char *name, qint64 begin, qint64 end)
+{
+    auto &traceBuffer = buffer();
+    const auto tid = threadId();
+    const auto index = traceBuffer.next.fetchAndAddRelaxed(1);
+    auto &event = traceBuffer.events[index & (TRACE_CAPACITY - 1)];
+    // the slot is still being written by a thread that wrapped around the buffer
+    const auto seq = event.seq.load();
+    if(seq == TRACE_BUSY || !event.seq.testAndSetRelaxed(seq, TRACE_BUSY))
+        return;
+    // the fields must not become visible before the slot is marked busy
+    std::atomic_thread_fence(std::memory_order_release);
+    event.name.store(name);
+    event.tid.store(tid);
+    event.begin.store(begin);
+    event.duration.store(end - begin);
+    event.seq.storeRelease(index + 1);
+}
+
+qint64 MapTrace::now()
+{
+    return buffer().clock.nsecsElapsed();
+}
+
+void MapTrace::clear()
+{
+    auto &traceBuffer = buffer();
+    for(auto &event : traceBuffer.events) {
+        // a slot being written keeps its writer, the event recorded there survives the clear
+        const auto seq = event.seq.load();
+        if(seq != TRACE_BUSY)
+            event.seq.testAndSetRelaxed(seq, 0);
+    }
+}
+
+/// \details 时间单位为微秒，线程名称作为元数据事件导出；正在写入或被覆盖的事件跳过
+bool MapTrace::dump(const QString &fileName)
+{
+    auto &traceBuffer = buffer();
+    const auto pid = QCoreApplication::applicationPid();
+    QJsonArray events;
+    for(const auto &event : traceBuffer.events) {
+        const auto seq = event.seq.loadAcquire();
+        if(!seq || seq == TRACE_BUSY)
+            continue;
+        const auto name = event.name.load();
+        const auto tid = event.tid.load();
+        const auto begin = event.begin.load();
+        const auto duration = event.duration.load();
+        // the fields must be read before the sequence is checked again
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(event.seq.load() != seq)
+            continue;
+        events.append(QJsonObject{
+            {"name", QString::fromLatin1(name)},
+            {"ph", "X"},
+            {"ts", begin / 1000.0},
+            {"dur", duration / 1000.0},
+            {"pid", pid},
+            {"tid", qint64(tid)}
+        });
+    }
+    {
+        QMutexLocker locker(&traceBuffer.mutex);
+        for(auto iter = traceBuffer.threadNames.cbegin(); iter != traceBuffer.threadNames.cend(); ++iter) {
+            events.append(QJsonObject{
+                {"name", "thread_name"},
+                {"ph", "M"},
+                {"pid", pid},
+                {"tid", qint64(iter.key())},
+                {"args", QJsonObject{{"name", iter.value()}}}
+            });
+        }
+    }
+    QFile file(fileName);
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    const QJsonObject trace{{"traceEvents", events}, {"displayTimeUnit", "ms"}};
+    return file.write(QJsonDocument(trace).toJson(QJsonDocument::Compact)) > 0;
+}
+
+#else
+
+MapTrace::Scope::Scope(const char *name) :
+    m_name(name),
+    m_begin(0)
+{
+}
+
+MapTrace::Scope::~Scope()
+{
+}
+
+bool MapTrace::isAvailable()
+{
+    return false;
+}
+
+void MapTrace::record(const char *name, qint64 begin, qint64 end)
+{
+    Q_UNUSED(name)
+    Q_UNUSED(begin)
+    Q_UNUSED(end)
+}
+
+qint64 MapTrace::now()
+{
+    return 0;
+}
+
+void MapTrace::clear()
+{
+}
+
+bool MapTrace::dump(const QString &fileName)
+{
+    Q_UNUSED(fileName)
+    return false;
+}
+
+#endif
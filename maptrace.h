@@ -0,0 +1,50 @@
+﻿#ifndef MAPTRACE_H
+#define MAPTRACE_H
+
+#include "GraphicsMapLib_global.h"
+#include <QString>
+
+/*!
+ * \brief 瓦片管线和绘制的耗时记录
+ * \details 通过MAP_TRACE_SCOPE记录作用域的开始时间、耗时和线程，事件写入固定容量的无锁环形缓冲区，写满后覆盖最早的事件。
+ * dump()按Chrome trace event格式导出，可以在chrome://tracing或Perfetto中查看。
+ * 只有定义GRAPHICSMAPLIB_TRACE(CMake选项GRAPHICSMAPLIB_TRACE)时才会记录，否则MAP_TRACE_SCOPE展开为空，没有任何开销
+ * \note 事件名称必须是静态字符串，缓冲区只保存指针
+ */
+class GRAPHICSMAPLIB_EXPORT MapTrace
+{
+public:
+    /// 作用域耗时记录，析构时写入事件
+    class GRAPHICSMAPLIB_EXPORT Scope
+    {
+    public:
+        explicit Scope(const char *name);
+        ~Scope();
+
+    private:
+        const char *m_name;
+        qint64      m_begin;
+    };
+
+    /// 是否编译了记录功能
+    static bool isAvailable();
+    /// 记录一个事件 \param begin 开始时间(纳秒，参见now()) \param end 结束时间(纳秒)
+    static void record(const char *name, qint64 begin, qint64 end);
+    /// 自第一次记录以来的时间(纳秒)
+    static qint64 now();
+    /// 清空已记录的事件
+    static void clear();
+    /// 按Chrome trace event格式导出已记录的事件 \return 是否成功，未编译记录功能时返回false
+    static bool dump(const QString &fileName);
+};
+
+#ifdef GRAPHICSMAPLIB_TRACE
+#define MAP_TRACE_CONCAT_(a, b) a##b
+#define MAP_TRACE_CONCAT(a, b) MAP_TRACE_CONCAT_(a, b)
+/// 记录当前作用域的耗时
+#define MAP_TRACE_SCOPE(name) MapTrace::Scope MAP_TRACE_CONCAT(mapTraceScope, __LINE__)(name)
+#else
+#define MAP_TRACE_SCOPE(name) ((void)0)
+#endif
+
+#endif // MAPTRACE_H
@@ -0,0 +1,211 @@
+﻿#include "sharedtilecache.h"
+#include "tiletable.h"
+#include <atomic>
+#include <limits>
+#include <cstring>
+
+#define CACHE_MAGIC 0x43544D47          ///< 共享内存标识"GMTC"(小端序)
+#define CACHE_VERSION 1
+#define CACHE_WAYS 4                    ///< 每组槽位数量
+#define HEADER_SIZE 64                  ///< 共享内存头大小
+#define SLOT_HEADER_SIZE 64             ///< 槽位头大小
+#define SLOT_DATA (256 * 256 * 4)       ///< 槽位图片数据大小，可存放一张256*256的RGBA瓦片
+#define SLOT_STRIDE (SLOT_HEADER_SIZE + SLOT_DATA)
+
+/// 共享内存头
+struct SharedTileCache::CacheHeader {
+    quint32 magic;
+    quint32 version;
+    quint32 slotCount;
+    quint32 slotStride;
+    QBasicAtomicInteger<quint32> stamp;     ///< 写入计数，组内替换最早写入的槽位
+};
+
+/// 槽位头，后面紧跟图片数据
+struct SharedTileCache::SlotHeader {
+    QBasicAtomicInteger<quint32> seq;       ///< 序号，奇数代表正在写入
+    quint32 stamp;          ///< 写入时的计数，0代表空槽位
+    quint64 source;         ///< 数据源名称散列
+    quint64 key;            ///< 高8位为层级，低48位为Morton编码
+    quint32 width;
+    quint32 height;
+    quint32 bytesPerLine;
+    quint32 format;
+};
+
+SharedTileCache::SharedTileCache(const QString &key) :
+    m_memory(key),
+    m_header(nullptr),
+    m_slots(nullptr),
+    m_slotCount(0),
+    m_hits(0),
+    m_misses(0)
+{
+    static_assert(sizeof(CacheHeader) <= HEADER_SIZE, "cache header overflow");
+    static_assert(sizeof(SlotHeader) <= SLOT_HEADER_SIZE, "slot header overflow");
+}
+
+SharedTileCache::~SharedTileCache()
+{
+    detach();
+}
+
+/// \details 新建的共享内存内容为0，第一个加锁的进程(不一定是创建者)按共享内存的实际大小写入内存头，之后的读写都不再加锁
+bool SharedTileCache::attach(qint64 bytes)
+{
+    detach();
+    const auto size = qBound<qint64>(HEADER_SIZE + qint64(SLOT_STRIDE) * CACHE_WAYS, bytes, std::numeric_limits<int>::max());
+    if(!m_memory.create(int(size)) && (m_memory.error() != QSharedMemory::AlreadyExists || !m_memory.attach()))
+        return false;
+    m_memory.lock();
+    auto header = static_cast<CacheHeader*>(m_memory.data());
+    if(header->magic == 0) {
+        header->magic = CACHE_MAGIC;
+        header->version = CACHE_VERSION;
+        header->slotCount = quint32((m_memory.size() - HEADER_SIZE) / SLOT_STRIDE / CACHE_WAYS * CACHE_WAYS);
+        header->slotStride = SLOT_STRIDE;
+    }
+    const bool valid = header->magic == CACHE_MAGIC && header->version == CACHE_VERSION
+            && header->slotStride == SLOT_STRIDE && header->slotCount > 0 && header->slotCount % CACHE_WAYS == 0
+            && HEADER_SIZE + qint64(header->slotCount) * SLOT_STRIDE <= m_memory.size();
+    m_memory.unlock();
+    if(!valid) {
+        m_memory.detach();
+        return false;
+    }
+    m_header = header;
+    m_slots = static_cast<uchar*>(m_memory.data()) + HEADER_SIZE;
+    m_slotCount = int(header->slotCount);
+    return true;
+}
+
+void SharedTileCache::detach()
+{
+    m_header = nullptr;
+    m_slots = nullptr;
+    m_slotCount = 0;
+    if(m_memory.isAttached())
+        m_memory.detach();
+}
+
+bool SharedTileCache::isAttached() const
+{
+    return m_header;
+}
+
+/// \note 读取过程中槽位可能被其他进程改写，字段先做范围检查，复制完成后再通过序号确认
+QImage SharedTileCache::find(const QString &source, quint8 zoom, quint32 x, quint32 y) const
+{
+    if(!m_header)
+        return QImage();
+    const auto sourceId = sourceHash(source);
+    const auto key = (quint64(zoom) << 56) | tileMorton(x, y);
+    const int first = firstSlot(sourceId, key);
+    for(int i = first; i < first + CACHE_WAYS; ++i) {
+        auto entry = slot(i);
+        const auto seq = entry->seq.loadAcquire();
+        if((seq & 1) || entry->source != sourceId || entry->key != key)
+            continue;
+        const int width = int(entry->width);
+        const int height = int(entry->height);
+        const int bytesPerLine = int(entry->bytesPerLine);
+        const int format = int(entry->format);
+        if(width <= 0 || height <= 0 || format <= QImage::Format_Invalid || format >= QImage::NImageFormats
+                || qint64(bytesPerLine) * height > SLOT_DATA)
+            continue;
+        QImage image(width, height, QImage::Format(format));
+        if(image.isNull())
+            continue;
+        const auto data = reinterpret_cast<const uchar*>(entry) + SLOT_HEADER_SIZE;
+        const int lineBytes = qMin(bytesPerLine, image.bytesPerLine());
+        for(int row = 0; row < height; ++row) {
+            memcpy(image.scanLine(row), data + row * bytesPerLine, size_t(lineBytes));
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // it was rewritten while copying
+        if(entry->seq.load() != seq)
+            continue;
+        m_hits.fetchAndAddRelaxed(1);
+        return image;
+    }
+    m_misses.fetchAndAddRelaxed(1);
+    return QImage();
+}
+
+/// \note 槽位正在被其他进程或线程写入时直接放弃，不等待
+void SharedTileCache::insert(const QString &source, quint8 zoom, quint32 x, quint32 y, const QImage &image)
+{
+    if(!m_header || image.isNull())
+        return;
+    // the colour table is not stored
+    const QImage pixels = image.colorCount() > 0 ? image.convertToFormat(QImage::Format_ARGB32) : image;
+    if(qint64(pixels.bytesPerLine()) * pixels.height() > SLOT_DATA)
+        return;
+    const auto sourceId = sourceHash(source);
+    const auto key = (quint64(zoom) << 56) | tileMorton(x, y);
+    const int first = firstSlot(sourceId, key);
+    // the slot of the same tile, or the one written earliest in the set
+    SlotHeader *target = nullptr;
+    for(int i = first; i < first + CACHE_WAYS; ++i) {
+        auto entry = slot(i);
+        if(entry->source == sourceId && entry->key == key) {
+            target = entry;
+            break;
+        }
+        if(!target || qint32(entry->stamp - target->stamp) < 0)
+            target = entry;
+    }
+    const auto seq = target->seq.load();
+    if((seq & 1) || !target->seq.testAndSetAcquire(seq, seq + 1))
+        return;
+    target->source = sourceId;
+    target->key = key;
+    target->width = quint32(pixels.width());
+    target->height = quint32(pixels.height());
+    target->bytesPerLine = quint32(pixels.bytesPerLine());
+    target->format = quint32(pixels.format());
+    memcpy(reinterpret_cast<uchar*>(target) + SLOT_HEADER_SIZE, pixels.constBits(), size_t(pixels.bytesPerLine()) * pixels.height());
+    target->stamp = m_header->stamp.fetchAndAddRelaxed(1) + 1;
+    target->seq.storeRelease(seq + 2);
+}
+
+int SharedTileCache::slotCount() const
+{
+    return m_slotCount;
+}
+
+qint64 SharedTileCache::size() const
+{
+    return isAttached() ? m_memory.size() : 0;
+}
+
+qint64 SharedTileCache::hits() const
+{
+    return m_hits.loadAcquire();
+}
+
+qint64 SharedTileCache::misses() const
+{
+    return m_misses.loadAcquire();
+}
+
+quint64 SharedTileCache::sourceHash(const QString &source)
+{
+    quint64 hash = 0xcbf29ce484222325ull;
+    for(auto c : source.toUtf8()) {
+        hash ^= quint8(c);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+int SharedTileCache::firstSlot(quint64 source, quint64 key) const
+{
+    const quint64 hash = (source ^ key) * 0x9E3779B97F4A7C15ull;
+    return int((hash >> 32) % quint64(m_slotCount / CACHE_WAYS)) * CACHE_WAYS;
+}
+
+SharedTileCache::SlotHeader *SharedTileCache::slot(int index) const
+{
+    return reinterpret_cast<SlotHeader*>(m_slots + qint64(index) * SLOT_STRIDE);
+}
@@ -0,0 +1,60 @@
+﻿#ifndef SHAREDTILECACHE_H
+#define SHAREDTILECACHE_H
+
+#include "GraphicsMapLib_global.h"
+#include <QSharedMemory>
+#include <QImage>
+#include <QAtomicInteger>
+
+/*!
+ * \brief 跨进程共享的瓦片缓存
+ * \details 同一主机上使用相同名称的进程通过共享内存共享解码后的瓦片，一个进程解码的瓦片可供所有进程直接使用。
+ * 共享内存由固定大小的槽位组成，瓦片按(数据源名称,层级,x,y)散列到4路组相联的槽位组中，组内按写入先后替换。
+ * 每个槽位带有序号锁(seqlock)：写入时序号为奇数，读取前后序号一致才视为命中，读写都不加锁
+ * \note 1.数据源名称相同的进程必须使用相同的瓦片协议(TMS/XYZ)
+ * 2.写入中途退出的进程会使该槽位一直处于写入状态，不再被使用，直到所有进程断开后共享内存被销毁
+ */
+class GRAPHICSMAPLIB_EXPORT SharedTileCache
+{
+public:
+    /// \param key 共享内存名称
+    explicit SharedTileCache(const QString &key);
+    ~SharedTileCache();
+    /// 创建或连接共享内存 \param bytes 缓存大小，连接已有的共享内存时使用其原有大小
+    bool attach(qint64 bytes);
+    void detach();
+    bool isAttached() const;
+    /// 查找瓦片图片，不存在时返回空图片
+    QImage find(const QString &source, quint8 zoom, quint32 x, quint32 y) const;
+    /// 放入瓦片图片，超出槽位大小的图片不缓存 \note 可以在任意线程中并发调用
+    void insert(const QString &source, quint8 zoom, quint32 x, quint32 y, const QImage &image);
+    /// 槽位数量
+    int slotCount() const;
+    /// 共享内存大小(字节)
+    qint64 size() const;
+    /// 本进程的命中次数
+    qint64 hits() const;
+    /// 本进程的未命中次数
+    qint64 misses() const;
+
+public:
+    /// 数据源名称的64位散列(FNV-1a)，不依赖进程的散列种子
+    static quint64 sourceHash(const QString &source);
+
+private:
+    struct CacheHeader;
+    struct SlotHeader;
+    /// 槽位组的第一个槽位
+    int firstSlot(quint64 source, quint64 key) const;
+    SlotHeader *slot(int index) const;
+
+private:
+    QSharedMemory m_memory;
+    CacheHeader  *m_header;         ///< 共享内存头
+    uchar        *m_slots;          ///< 第一个槽位
+    int           m_slotCount;      ///< 槽位数量，4的倍数
+    mutable QAtomicInteger<qint64> m_hits;
+    mutable QAtomicInteger<qint64> m_misses;
+};
+
+#endif // SHAREDTILECACHE_H
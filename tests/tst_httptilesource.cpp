@@ -0,0 +1,186 @@
+﻿#include "tilesource.h"
+#include <QtTest>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QBuffer>
+#include <QImage>
+#include <QTemporaryDir>
+#include <QThread>
+
+/*!
+ * \brief 本地瓦片服务
+ * \details 在自己的线程中按路径应答：/{z}/0/0.png返回瓦片，/{z}/1/0.png返回404，/{z}/0/1.png返回500，/{z}/1/1.png不应答(超时)
+ */
+class TileServer : public QTcpServer
+{
+    Q_OBJECT
+public:
+    TileServer()
+    {
+        QImage image(256, 256, QImage::Format_ARGB32);
+        image.fill(Qt::red);
+        QBuffer buffer(&m_tile);
+        buffer.open(QIODevice::WriteOnly);
+        image.save(&buffer, "PNG");
+    }
+    QByteArray tile() const
+    {
+        return m_tile;
+    }
+    /// 已接受的连接数量
+    int connectionCount() const
+    {
+        return m_connections.loadAcquire();
+    }
+
+protected:
+    void incomingConnection(qintptr handle) override
+    {
+        m_connections.fetchAndAddRelaxed(1);
+        auto socket = new QTcpSocket(this);
+        socket->setSocketDescriptor(handle);
+        connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket](){
+            m_requests[socket] += socket->readAll();
+            auto &request = m_requests[socket];
+            // keep-alive connections carry one request after another
+            int end;
+            while((end = request.indexOf("\r\n\r\n")) >= 0) {
+                const auto path = request.left(request.indexOf("\r\n")).split(' ').value(1);
+                request.remove(0, end + 4);
+                reply(socket, path);
+            }
+        });
+    }
+
+private:
+    void reply(QTcpSocket *socket, const QByteArray &path)
+    {
+        if(path.endsWith("/0/0.png"))
+            socket->write("HTTP/1.1 200 OK\r\nContent-Type: image/png\r\nContent-Length: "
+                          + QByteArray::number(m_tile.size()) + "\r\n\r\n" + m_tile);
+        else if(path.endsWith("/1/0.png"))
+            socket->write("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        else if(path.endsWith("/0/1.png"))
+            socket->write("HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n");
+        // anything else is left unanswered
+    }
+
+private:
+    QByteArray m_tile;
+    QHash<QTcpSocket*, QByteArray> m_requests;
+    QAtomicInt m_connections;
+};
+
+class HttpTileSourceTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void hit();
+    void notFound();
+    void serverError();
+    void timeout();
+    void failedSignal();
+
+private:
+    QString urlTemplate() const;
+
+private:
+    QThread     m_serverThread;
+    TileServer *m_server = nullptr;
+};
+
+void HttpTileSourceTest::initTestCase()
+{
+    qRegisterMetaType<GraphicsMap::TileSpec>("GraphicsMap::TileSpec");
+    m_server = new TileServer;
+    m_server->moveToThread(&m_serverThread);
+    m_serverThread.start();
+    bool listening = false;
+    QMetaObject::invokeMethod(m_server, [this, &listening](){
+        listening = m_server->listen(QHostAddress::LocalHost);
+    }, Qt::BlockingQueuedConnection);
+    QVERIFY(listening);
+}
+
+void HttpTileSourceTest::cleanupTestCase()
+{
+    QMetaObject::invokeMethod(m_server, [this](){
+        delete m_server;
+    }, Qt::BlockingQueuedConnection);
+    m_serverThread.quit();
+    m_serverThread.wait();
+}
+
+QString HttpTileSourceTest::urlTemplate() const
+{
+    return QString("http://127.0.0.1:%1/tiles/{z}/{x}/{y}.png").arg(m_server->serverPort());
+}
+
+/// 返回瓦片，写入磁盘缓存，同一线程的请求复用连接
+void HttpTileSourceTest::hit()
+{
+    QTemporaryDir cacheDir;
+    QVERIFY(cacheDir.isValid());
+    const int connections = m_server->connectionCount();
+    {
+        HttpTileSource source(urlTemplate(), cacheDir.path());
+        QByteArray data;
+        QVERIFY(source.tryRead({1, 2, 0, 0}, data));
+        QCOMPARE(data, m_server->tile());
+        QVERIFY(source.tryRead({1, 3, 0, 0}, data));
+        QCOMPARE(data, m_server->tile());
+        // the second request reuses the connection of the first
+        QVERIFY(m_server->connectionCount() <= connections + 1);
+    }
+    // the source waits for its background writes when destroyed
+    QFile file(cacheDir.path() + "/2/0/0.png");
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.readAll(), m_server->tile());
+}
+
+/// 404代表瓦片不存在：成功，数据为空
+void HttpTileSourceTest::notFound()
+{
+    HttpTileSource source(urlTemplate());
+    QByteArray data("stale");
+    QVERIFY(source.tryRead({1, 2, 1, 0}, data));
+    QVERIFY(data.isEmpty());
+}
+
+void HttpTileSourceTest::serverError()
+{
+    HttpTileSource source(urlTemplate());
+    QByteArray data;
+    QVERIFY(!source.tryRead({1, 2, 0, 1}, data));
+    QVERIFY(data.isEmpty());
+}
+
+void HttpTileSourceTest::timeout()
+{
+    HttpTileSource source(urlTemplate());
+    source.setTimeout(200);
+    QElapsedTimer timer;
+    timer.start();
+    QByteArray data;
+    QVERIFY(!source.tryRead({1, 2, 1, 1}, data));
+    QVERIFY(timer.elapsed() < 5000);
+}
+
+/// 异步读取失败发出failed信号而不是fetched信号
+void HttpTileSourceTest::failedSignal()
+{
+    HttpTileSource source(urlTemplate());
+    QSignalSpy fetchedSpy(&source, &TileSource::fetched);
+    QSignalSpy failedSpy(&source, &TileSource::failed);
+    source.fetch({1, 2, 0, 1});
+    QTRY_COMPARE_WITH_TIMEOUT(failedSpy.count(), 1, 5000);
+    QCOMPARE(fetchedSpy.count(), 0);
+}
+
+QTEST_GUILESS_MAIN(HttpTileSourceTest)
+
+#include "tst_httptilesource.moc"
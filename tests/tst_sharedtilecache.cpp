@@ -0,0 +1,144 @@
+﻿#include "sharedtilecache.h"
+#include <QtTest>
+#include <QProcess>
+
+#define TEST_CACHE_BYTES (qint64(16) * 256 * 256 * 4 + 64 * 1024)   ///< 16个槽位左右
+#define TEST_SOURCE "test-source"
+#define WRITER_ROUNDS 20000                                         ///< 并发写入进程的写入次数
+
+namespace {
+
+/// 第n次写入的瓦片，所有像素相同，读到不同的像素说明读到了写入一半的槽位
+QImage testTile(int n)
+{
+    QImage image(256, 256, QImage::Format_ARGB32);
+    image.fill(QRgb(0xFF000000u | ((quint32(n) * 2654435761u) & 0xFFFFFFu)));
+    return image;
+}
+
+bool isUniform(const QImage &image)
+{
+    const auto first = reinterpret_cast<const QRgb*>(image.constScanLine(0))[0];
+    for(int y = 0; y < image.height(); ++y) {
+        const auto line = reinterpret_cast<const QRgb*>(image.constScanLine(y));
+        for(int x = 0; x < image.width(); ++x) {
+            if(line[x] != first)
+                return false;
+        }
+    }
+    return true;
+}
+
+/// 子进程：连接共享内存后写入瓦片 \param mode insert写入一次，churn反复改写同一瓦片
+int runWriter(const QString &key, const QString &mode)
+{
+    SharedTileCache cache(key);
+    if(!cache.attach(TEST_CACHE_BYTES))
+        return 2;
+    if(mode == "insert") {
+        cache.insert(TEST_SOURCE, 3, 1, 2, testTile(1));
+        return 0;
+    }
+    for(int n = 0; n < WRITER_ROUNDS; ++n) {
+        cache.insert(TEST_SOURCE, 5, 7, 9, testTile(n));
+    }
+    return 0;
+}
+
+}
+
+/*!
+ * \brief 跨进程共享瓦片缓存测试
+ * \details 测试程序以--writer参数启动自身作为写入进程
+ */
+class SharedTileCacheTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void crossProcess();
+    void concurrentWriter();
+
+private:
+    /// 启动写入进程
+    void startWriter(QProcess &process, const QString &mode);
+
+private:
+    QString          m_key;
+    SharedTileCache *m_cache = nullptr;
+};
+
+void SharedTileCacheTest::initTestCase()
+{
+    m_key = QString("GraphicsMapTest%1").arg(QCoreApplication::applicationPid());
+    m_cache = new SharedTileCache(m_key);
+    QVERIFY(m_cache->attach(TEST_CACHE_BYTES));
+}
+
+void SharedTileCacheTest::cleanupTestCase()
+{
+    delete m_cache;
+}
+
+void SharedTileCacheTest::startWriter(QProcess &process, const QString &mode)
+{
+    process.start(QCoreApplication::applicationFilePath(), {"--writer", m_key, mode});
+    QVERIFY(process.waitForStarted());
+}
+
+/// 另一个进程写入的瓦片在本进程命中
+void SharedTileCacheTest::crossProcess()
+{
+    QVERIFY(m_cache->find(TEST_SOURCE, 3, 1, 2).isNull());
+    QProcess process;
+    startWriter(process, "insert");
+    QVERIFY(process.waitForFinished());
+    QCOMPARE(process.exitStatus(), QProcess::NormalExit);
+    QCOMPARE(process.exitCode(), 0);
+    const auto image = m_cache->find(TEST_SOURCE, 3, 1, 2);
+    QVERIFY(!image.isNull());
+    QCOMPARE(image.size(), QSize(256, 256));
+    QCOMPARE(image.pixel(0, 0), testTile(1).pixel(0, 0));
+    QVERIFY(m_cache->find(TEST_SOURCE, 3, 2, 1).isNull());
+    QVERIFY(m_cache->find("other-source", 3, 1, 2).isNull());
+}
+
+/// 另一个进程反复改写同一瓦片时，读到的瓦片都是完整的
+void SharedTileCacheTest::concurrentWriter()
+{
+    QProcess process;
+    startWriter(process, "churn");
+    int found = 0;
+    forever {
+        for(int i = 0; i < 100; ++i) {
+            const auto image = m_cache->find(TEST_SOURCE, 5, 7, 9);
+            if(image.isNull())
+                continue;
+            ++found;
+            QVERIFY2(isUniform(image), "torn read");
+        }
+        if(process.waitForFinished(1))
+            break;
+    }
+    QCOMPARE(process.exitCode(), 0);
+    QVERIFY(found > 0);
+    // the last write is complete
+    const auto image = m_cache->find(TEST_SOURCE, 5, 7, 9);
+    QVERIFY(!image.isNull());
+    QCOMPARE(image.pixel(0, 0), testTile(WRITER_ROUNDS - 1).pixel(0, 0));
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    const auto args = app.arguments();
+    if(args.value(1) == "--writer")
+        return runWriter(args.value(2), args.value(3));
+    SharedTileCacheTest test;
+    QTEST_SET_MAIN_SOURCE_PATH
+    return QTest::qExec(&test, argc, argv);
+}
+
+#include "tst_sharedtilecache.moc"
@@ -0,0 +1,226 @@
+﻿#include "tilearchive.h"
+#include "tileindex.h"
+#include "tiletable.h"
+#include <QDir>
+#include <QCryptographicHash>
+#include <QHash>
+#include <QtEndian>
+#include <QVector>
+#include <algorithm>
+
+#define ARCHIVE_MAGIC 0x41544D47      ///< 文件标识"GMTA"(小端序)
+#define ARCHIVE_VERSION 1
+#define HEADER_SIZE 32                ///< magic(4) version(4) count(4) reserved(4) indexOffset(8) dataOffset(8)
+#define ENTRY_SIZE 24                 ///< key(8) offset(8) length(4) format(1) reserved(3)
+#define MAX_ZOOM 24                   ///< Morton编码中x、y各占24位
+
+TileArchive::TileArchive() :
+    m_data(nullptr),
+    m_size(0),
+    m_entries(nullptr),
+    m_count(0)
+{
+
+}
+
+TileArchive::~TileArchive()
+{
+    close();
+}
+
+bool TileArchive::open(const QString &fileName)
+{
+    close();
+    m_file.setFileName(fileName);
+    if(!m_file.open(QIODevice::ReadOnly))
+        return false;
+    m_size = m_file.size();
+    m_data = m_size >= HEADER_SIZE ? m_file.map(0, m_size) : nullptr;
+    if(!m_data) {
+        close();
+        return false;
+    }
+    // validate header and index range
+    auto magic = qFromLittleEndian<quint32>(m_data);
+    auto version = qFromLittleEndian<quint32>(m_data + 4);
+    auto count = qFromLittleEndian<quint32>(m_data + 8);
+    auto indexOffset = qFromLittleEndian<quint64>(m_data + 16);
+    if(magic != ARCHIVE_MAGIC || version != ARCHIVE_VERSION
+            || indexOffset + quint64(count) * ENTRY_SIZE > quint64(m_size)) {
+        close();
+        return false;
+    }
+    m_count = count;
+    m_entries = m_data + indexOffset;
+    return true;
+}
+
+void TileArchive::close()
+{
+    if(m_data)
+        m_file.unmap(const_cast<uchar*>(m_data));
+    m_file.close();
+    m_data = nullptr;
+    m_size = 0;
+    m_entries = nullptr;
+    m_count = 0;
+}
+
+bool TileArchive::isOpen() const
+{
+    return m_data;
+}
+
+QByteArray TileArchive::tile(quint8 zoom, quint32 x, quint32 y) const
+{
+    auto entry = findEntry(zoom, x, y);
+    if(!entry)
+        return QByteArray();
+    auto offset = qFromLittleEndian<quint64>(entry + 8);
+    auto length = qFromLittleEndian<quint32>(entry + 16);
+    if(offset + length > quint64(m_size))
+        return QByteArray();
+    return QByteArray::fromRawData(reinterpret_cast<const char*>(m_data + offset), int(length));
+}
+
+bool TileArchive::contains(quint8 zoom, quint32 x, quint32 y) const
+{
+    return findEntry(zoom, x, y);
+}
+
+int TileArchive::maxZoom() const
+{
+    // entries are sorted by zoom at first
+    if(!m_count)
+        return -1;
+    auto key = qFromLittleEndian<quint64>(m_entries + quint64(m_count - 1) * ENTRY_SIZE);
+    return int(key >> 56);
+}
+
+int TileArchive::count() const
+{
+    return int(m_count);
+}
+
+quint64 TileArchive::tileKey(quint8 zoom, quint32 x, quint32 y)
+{
+    return (quint64(zoom) << 56) | tileMorton(x, y);
+}
+
+const uchar *TileArchive::findEntry(quint8 zoom, quint32 x, quint32 y) const
+{
+    if(!m_data || zoom > MAX_ZOOM)
+        return nullptr;
+    const auto key = tileKey(zoom, x, y);
+    quint32 low = 0, high = m_count;
+    while (low < high) {
+        auto mid = low + (high - low) / 2;
+        auto entry = m_entries + quint64(mid) * ENTRY_SIZE;
+        auto midKey = qFromLittleEndian<quint64>(entry);
+        if(midKey == key)
+            return entry;
+        else if(midKey < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return nullptr;
+}
+
+bool TileArchive::pack(const QString &path, const QString &fileName, QString *error)
+{
+    auto fail = [error](const QString &message) {
+        if(error)
+            *error = message;
+        return false;
+    };
+    /// 待打包瓦片
+    struct PackEntry {
+        quint64 key;
+        QString filePath;
+        quint8  format;
+        bool operator< (const PackEntry &rhs) const { return key < rhs.key; }
+    };
+    // collect tiles with the same rules as the tile loader
+    QDir root(path);
+    if(!root.exists())
+        return fail(QString("tile directory %1 does not exist").arg(path));
+    QVector<PackEntry> entries;
+    bool ok;
+    for(const auto &zoomName : root.entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+        auto zoom = zoomName.toUInt(&ok);
+        if(!ok || zoom > MAX_ZOOM)
+            continue;
+        QDir zoomDir(root.filePath(zoomName));
+        for(const auto &xName : zoomDir.entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+            auto x = xName.toUInt(&ok);
+            if(!ok)
+                continue;
+            QDir xDir(zoomDir.filePath(xName));
+            for(const auto &tileName : xDir.entryList({"*.jpg", "*.png"}, QDir::Files)) {
+                auto y = tileName.section('.', 0, 0).toUInt(&ok);
+                if(!ok)
+                    continue;
+                auto format = tileName.endsWith(".jpg") ? TileIndex::Jpg : TileIndex::Png;
+                entries.append({tileKey(zoom, x, y), xDir.filePath(tileName), format});
+            }
+        }
+    }
+    // jpg goes first if both exist, same as the tile loader
+    std::stable_sort(entries.begin(), entries.end(), [](const PackEntry &lhs, const PackEntry &rhs){
+        return lhs.key < rhs.key || (lhs.key == rhs.key && lhs.format < rhs.format);
+    });
+    entries.erase(std::unique(entries.begin(), entries.end(), [](const PackEntry &lhs, const PackEntry &rhs){
+        return lhs.key == rhs.key;
+    }), entries.end());
+
+    //
+    QFile file(fileName);
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return fail(QString("can not write %1: %2").arg(fileName, file.errorString()));
+    const quint64 indexOffset = HEADER_SIZE;
+    const quint64 dataOffset = indexOffset + quint64(entries.size()) * ENTRY_SIZE;
+    {
+        uchar header[HEADER_SIZE] = {0};
+        qToLittleEndian<quint32>(ARCHIVE_MAGIC, header);
+        qToLittleEndian<quint32>(ARCHIVE_VERSION, header + 4);
+        qToLittleEndian<quint32>(quint32(entries.size()), header + 8);
+        qToLittleEndian<quint64>(indexOffset, header + 16);
+        qToLittleEndian<quint64>(dataOffset, header + 24);
+        file.write(reinterpret_cast<const char*>(header), HEADER_SIZE);
+    }
+    // index is written after the blobs when all offsets are known
+    QByteArray index(int(dataOffset - indexOffset), '\0');
+    file.write(index);
+    quint64 offset = dataOffset;
+    // identical tiles (sea, empty land) share one blob, the index just points at the same offset
+    QHash<QByteArray, quint64> blobOffsets;
+    for(int i = 0; i < entries.size(); ++i) {
+        const auto &entry = entries.at(i);
+        QFile tileFile(entry.filePath);
+        if(!tileFile.open(QIODevice::ReadOnly))
+            return fail(QString("can not read %1: %2").arg(entry.filePath, tileFile.errorString()));
+        auto data = tileFile.readAll();
+        auto hash = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+        auto blob = blobOffsets.constFind(hash);
+        quint64 blobOffset = offset;
+        if(blob != blobOffsets.constEnd()) {
+            blobOffset = blob.value();
+        }
+        else {
+            if(file.write(data) != data.size())
+                return fail(QString("can not write %1: %2").arg(fileName, file.errorString()));
+            blobOffsets.insert(hash, offset);
+            offset += data.size();
+        }
+        //
+        auto indexEntry = reinterpret_cast<uchar*>(index.data()) + i * ENTRY_SIZE;
+        qToLittleEndian<quint64>(entry.key, indexEntry);
+        qToLittleEndian<quint64>(blobOffset, indexEntry + 8);
+        qToLittleEndian<quint32>(quint32(data.size()), indexEntry + 16);
+        indexEntry[20] = entry.format;
+    }
+    if(!file.seek(indexOffset) || file.write(index) != index.size())
+        return fail(QString("can not write %1: %2").arg(fileName, file.errorString()));
+    return true;
+}
@@ -0,0 +1,50 @@
+﻿#ifndef TILEARCHIVE_H
+#define TILEARCHIVE_H
+
+#include "GraphicsMapLib_global.h"
+#include <QFile>
+#include <QByteArray>
+
+/*!
+ * \brief 单文件瓦片包
+ * \details 用一个文件代替瓦片目录(path/z/x/y.jpg|png)，文件结构依次为：文件头、按(层级,Morton编码)排序的索引表、连续存放的瓦片数据。
+ * 读取时通过内存映射访问，tile()返回指向映射内存的数据，不做拷贝
+ * \note 所有字段均为小端序，索引中的y为磁盘文件的编号，TMS模式下需要调用方自行翻转
+ */
+class GRAPHICSMAPLIB_EXPORT TileArchive
+{
+public:
+    TileArchive();
+    ~TileArchive();
+    /// 打开瓦片包
+    bool open(const QString &fileName);
+    void close();
+    bool isOpen() const;
+    /// 获取瓦片数据，不存在时返回空 \note 返回的数据直接指向映射内存，仅在瓦片包关闭前有效
+    QByteArray tile(quint8 zoom, quint32 x, quint32 y) const;
+    /// 是否包含瓦片
+    bool contains(quint8 zoom, quint32 x, quint32 y) const;
+    /// 包含瓦片的最大层级，-1代表瓦片包为空
+    int maxZoom() const;
+    /// 瓦片总数
+    int count() const;
+
+public:
+    /// 将瓦片目录打包为单文件瓦片包，内容相同的瓦片只存放一份数据，索引项指向同一偏移
+    static bool pack(const QString &path, const QString &fileName, QString *error = nullptr);
+    /// 瓦片在索引表中的排序编号：高8位为层级，低48位为x、y交错的Morton编码
+    static quint64 tileKey(quint8 zoom, quint32 x, quint32 y);
+
+private:
+    /// 二分查找索引表，返回索引项地址，不存在返回nullptr
+    const uchar *findEntry(quint8 zoom, quint32 x, quint32 y) const;
+
+private:
+    QFile        m_file;
+    const uchar *m_data;     ///< 映射内存
+    qint64       m_size;     ///< 文件大小
+    const uchar *m_entries;  ///< 索引表起始地址
+    quint32      m_count;    ///< 瓦片数量
+};
+
+#endif // TILEARCHIVE_H
@@ -0,0 +1,262 @@
+﻿#include "tileindex.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QSaveFile>
+#include <QDataStream>
+#include <algorithm>
+
+#define DENSE_ZOOM 8        ///< 不超过该层级的索引使用位图存储(8级位图为8KB)
+#define MAX_ZOOM 24         ///< 索引支持的最大层级
+#define INDEX_FILE_NAME "tiles.idx"  ///< 瓦片目录下的索引文件名
+#define INDEX_MAGIC 0x474D5449       ///< 索引文件标识"GMTI"
+#define INDEX_VERSION 2                ///< 2：记录瓦片目录的指纹
+
+TileIndex::TileIndex() :
+    m_count(0),
+    m_stamp(0)
+{
+
+}
+
+TileIndex::Format TileIndex::format(quint8 zoom, quint32 x, quint32 y) const
+{
+    if(zoom >= m_levels.size())
+        return None;
+    const auto &level = m_levels.at(zoom);
+    if(zoom <= DENSE_ZOOM) {
+        const quint32 len = 1u << zoom;
+        if(x >= len || y >= len || level.jpgBits.isEmpty())
+            return None;
+        const int bit = y * len + x;
+        if(level.jpgBits.testBit(bit))
+            return Jpg;
+        if(level.pngBits.testBit(bit))
+            return Png;
+        return None;
+    }
+    //
+    const quint64 key = (quint64(x) << 32) | y;
+    auto iter = std::lower_bound(level.tiles.cbegin(), level.tiles.cend(), key);
+    if(iter == level.tiles.cend() || *iter != key)
+        return None;
+    return Format(level.formats.at(int(iter - level.tiles.cbegin())));
+}
+
+int TileIndex::maxZoom() const
+{
+    for(int zoom = m_levels.size() - 1; zoom >= 0; --zoom) {
+        const auto &level = m_levels.at(zoom);
+        if(!level.tiles.isEmpty() || level.jpgBits.count(true) || level.pngBits.count(true))
+            return zoom;
+    }
+    return -1;
+}
+
+int TileIndex::count() const
+{
+    return m_count;
+}
+
+quint64 TileIndex::stamp() const
+{
+    return m_stamp;
+}
+
+bool TileIndex::isCurrent(const QString &path, const QAtomicInt *cancel) const
+{
+    const auto stamp = directoryStamp(path, cancel);
+    return stamp && stamp == m_stamp;
+}
+
+QSharedPointer<TileIndex> TileIndex::open(const QString &path, const QAtomicInt *cancel)
+{
+    auto fileName = indexFileName(path);
+    auto index = load(fileName);
+    if(index && index->isCurrent(path, cancel))
+        return index;
+    index = scan(path, cancel);
+    // the tile directory may be read only, just ignore it
+    if(index)
+        index->save(fileName);
+    return index;
+}
+
+QString TileIndex::indexFileName(const QString &path)
+{
+    return QDir(path).filePath(INDEX_FILE_NAME);
+}
+
+/// \details 根目录的修改时间不计入，写入索引文件本身会改变它；增删层级目录会改变目录数量
+quint64 TileIndex::directoryStamp(const QString &path, const QAtomicInt *cancel)
+{
+    QDir root(path);
+    if(!root.exists())
+        return 0;
+    qint64 latest = 0;
+    quint64 count = 0;
+    bool ok;
+    for(const auto &zoomInfo : root.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+        zoomInfo.fileName().toUInt(&ok);
+        if(!ok)
+            continue;
+        latest = qMax(latest, zoomInfo.lastModified().toMSecsSinceEpoch());
+        ++count;
+        for(const auto &xInfo : QDir(zoomInfo.filePath()).entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+            if(cancel && cancel->loadAcquire())
+                return 0;
+            latest = qMax(latest, xInfo.lastModified().toMSecsSinceEpoch());
+            ++count;
+        }
+    }
+    const quint64 stamp = (quint64(latest) * 0x9E3779B97F4A7C15ull) ^ count;
+    return stamp ? stamp : 1;
+}
+
+/// \note 只列举目录内容，不对单个瓦片文件调用stat；目录指纹在扫描前取得，扫描期间的变化留待下次发现
+QSharedPointer<TileIndex> TileIndex::scan(const QString &path, const QAtomicInt *cancel)
+{
+    QDir root(path);
+    if(!root.exists())
+        return QSharedPointer<TileIndex>();
+    //
+    QSharedPointer<TileIndex> index(new TileIndex);
+    index->m_stamp = directoryStamp(path, cancel);
+    if(!index->m_stamp)
+        return QSharedPointer<TileIndex>();
+    bool ok;
+    for(const auto &zoomName : root.entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+        auto zoom = zoomName.toUInt(&ok);
+        if(!ok || zoom > MAX_ZOOM)
+            continue;
+        QDir zoomDir(root.filePath(zoomName));
+        for(const auto &xName : zoomDir.entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+            if(cancel && cancel->loadAcquire())
+                return QSharedPointer<TileIndex>();
+            auto x = xName.toUInt(&ok);
+            if(!ok)
+                continue;
+            QDir xDir(zoomDir.filePath(xName));
+            for(const auto &fileName : xDir.entryList({"*.jpg", "*.png"}, QDir::Files)) {
+                auto y = fileName.section('.', 0, 0).toUInt(&ok);
+                if(!ok)
+                    continue;
+                index->insert(zoom, x, y, fileName.endsWith(".jpg") ? Jpg : Png);
+            }
+        }
+    }
+    index->finish();
+    return index;
+}
+
+QSharedPointer<TileIndex> TileIndex::load(const QString &fileName)
+{
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadOnly))
+        return QSharedPointer<TileIndex>();
+    QDataStream stream(&file);
+    quint32 magic, version, levelCount;
+    quint64 stamp;
+    stream >> magic >> version >> stamp >> levelCount;
+    if(magic != INDEX_MAGIC || version != INDEX_VERSION || levelCount > MAX_ZOOM + 1)
+        return QSharedPointer<TileIndex>();
+    //
+    QSharedPointer<TileIndex> index(new TileIndex);
+    index->m_stamp = stamp;
+    for(quint32 zoom = 0; zoom < levelCount; ++zoom) {
+        quint32 count;
+        stream >> count;
+        // a file cut at a level boundary must not pass as an index without the deeper levels
+        if(stream.status() != QDataStream::Ok)
+            return QSharedPointer<TileIndex>();
+        for(quint32 i = 0; i < count; ++i) {
+            quint32 x, y;
+            quint8 format;
+            stream >> x >> y >> format;
+            if(stream.status() != QDataStream::Ok)
+                return QSharedPointer<TileIndex>();
+            index->insert(zoom, x, y, Format(format));
+        }
+    }
+    if(stream.status() != QDataStream::Ok || !stream.atEnd())
+        return QSharedPointer<TileIndex>();
+    index->finish();
+    return index;
+}
+
+/// \note 写入临时文件后替换，其他进程不会读到写了一半的索引
+bool TileIndex::save(const QString &fileName) const
+{
+    QSaveFile file(fileName);
+    if(!file.open(QIODevice::WriteOnly))
+        return false;
+    QDataStream stream(&file);
+    stream << quint32(INDEX_MAGIC) << quint32(INDEX_VERSION) << m_stamp << quint32(m_levels.size());
+    for(int zoom = 0; zoom < m_levels.size(); ++zoom) {
+        const auto &level = m_levels.at(zoom);
+        if(zoom <= DENSE_ZOOM) {
+            const quint32 len = 1u << zoom;
+            stream << quint32(level.jpgBits.count(true) + level.pngBits.count(true));
+            for(int bit = 0; bit < level.jpgBits.size(); ++bit) {
+                if(level.jpgBits.testBit(bit))
+                    stream << quint32(bit % len) << quint32(bit / len) << quint8(Jpg);
+                else if(level.pngBits.testBit(bit))
+                    stream << quint32(bit % len) << quint32(bit / len) << quint8(Png);
+            }
+        }
+        else {
+            stream << quint32(level.tiles.size());
+            for(int i = 0; i < level.tiles.size(); ++i) {
+                auto key = level.tiles.at(i);
+                stream << quint32(key >> 32) << quint32(key & 0xFFFFFFFF) << quint8(level.formats.at(i));
+            }
+        }
+    }
+    return stream.status() == QDataStream::Ok && file.commit();
+}
+
+void TileIndex::insert(quint8 zoom, quint32 x, quint32 y, Format format)
+{
+    if(zoom > MAX_ZOOM || format == None)
+        return;
+    if(zoom >= m_levels.size())
+        m_levels.resize(zoom + 1);
+    auto &level = m_levels[zoom];
+    if(zoom <= DENSE_ZOOM) {
+        const quint32 len = 1u << zoom;
+        if(x >= len || y >= len)
+            return;
+        if(level.jpgBits.isEmpty()) {
+            level.jpgBits.resize(len * len);
+            level.pngBits.resize(len * len);
+        }
+        const int bit = y * len + x;
+        if(level.jpgBits.testBit(bit) || level.pngBits.testBit(bit))
+            return;
+        (format == Jpg ? level.jpgBits : level.pngBits).setBit(bit);
+        ++m_count;
+    }
+    else {
+        level.building.append({(quint64(x) << 32) | y, format});
+    }
+}
+
+/// 同一瓦片同时存在jpg和png时，和逐个探测文件的规则一样优先使用jpg
+void TileIndex::finish()
+{
+    for(auto &level : m_levels) {
+        if(level.building.isEmpty())
+            continue;
+        std::sort(level.building.begin(), level.building.end());
+        for(const auto &tile : level.building) {
+            if(!level.tiles.isEmpty() && level.tiles.last() == tile.first)
+                continue;
+            level.tiles.append(tile.first);
+            level.formats.append(char(tile.second));
+            ++m_count;
+        }
+        level.building.clear();
+        level.building.squeeze();
+    }
+}
@@ -0,0 +1,72 @@
+﻿#ifndef TILEINDEX_H
+#define TILEINDEX_H
+
+#include "GraphicsMapLib_global.h"
+#include <QBitArray>
+#include <QVector>
+#include <QSharedPointer>
+#include <QAtomicInt>
+
+/*!
+ * \brief 瓦片可用性索引
+ * \details 记录瓦片金字塔每一层存在的瓦片及其格式，加载前通过索引判断瓦片是否存在，缺失瓦片不再产生任何磁盘访问。
+ * 低层级使用位图存储，高层级使用有序编号表存储
+ * 索引记录建立时瓦片目录的指纹(参见directoryStamp())，读取索引文件后据此判断目录内容是否已变化
+ * \note 索引中的y为磁盘文件的编号，TMS模式下需要调用方自行翻转
+ */
+class GRAPHICSMAPLIB_EXPORT TileIndex
+{
+public:
+    /// 瓦片文件格式
+    enum Format : quint8 {
+        None = 0,   ///< 瓦片不存在
+        Jpg  = 1,
+        Png  = 2
+    };
+
+    TileIndex();
+    /// 查询瓦片格式，None代表瓦片不存在
+    Format format(quint8 zoom, quint32 x, quint32 y) const;
+    /// 包含瓦片的最大层级，-1代表索引为空
+    int maxZoom() const;
+    /// 瓦片总数
+    int count() const;
+    /// 建立索引时瓦片目录的指纹
+    quint64 stamp() const;
+    /// 索引是否与瓦片目录的当前内容一致 \note 需要列举层级和列目录，中断时返回false
+    bool isCurrent(const QString &path, const QAtomicInt *cancel = nullptr) const;
+
+public:
+    /// 优先读取瓦片目录下的索引文件，不存在或与目录不一致时扫描目录建立索引并尝试写入索引文件 \param cancel 置为非0时中断扫描并返回空指针
+    static QSharedPointer<TileIndex> open(const QString &path, const QAtomicInt *cancel = nullptr);
+    /// 瓦片目录下的索引文件名
+    static QString indexFileName(const QString &path);
+    /// 瓦片目录的指纹：层级目录和列目录的数量及最新修改时间，增删瓦片文件会改变所在列目录的修改时间 \return 中断时返回0
+    static quint64 directoryStamp(const QString &path, const QAtomicInt *cancel = nullptr);
+    /// 扫描瓦片目录(path/z/x/y.jpg|png)建立索引
+    static QSharedPointer<TileIndex> scan(const QString &path, const QAtomicInt *cancel = nullptr);
+    /// 读取索引文件
+    static QSharedPointer<TileIndex> load(const QString &fileName);
+    /// 写入索引文件
+    bool save(const QString &fileName) const;
+
+private:
+    void insert(quint8 zoom, quint32 x, quint32 y, Format format);
+    /// 插入完成后整理有序编号表
+    void finish();
+
+private:
+    /// 单层索引
+    struct Level {
+        QBitArray jpgBits;          ///< 低层级jpg位图(y*边长+x)
+        QBitArray pngBits;          ///< 低层级png位图(y*边长+x)
+        QVector<quint64> tiles;     ///< 高层级有序编号表(x<<32|y)
+        QByteArray formats;         ///< 高层级编号表对应的瓦片格式
+        QVector<QPair<quint64, quint8>> building;   ///< 建立索引过程中的无序编号
+    };
+    QVector<Level> m_levels;
+    int            m_count;
+    quint64        m_stamp;     ///< 建立索引时瓦片目录的指纹
+};
+
+#endif // TILEINDEX_H
@@ -0,0 +1,430 @@
+﻿#include "tilesource.h"
+#include "tileindex.h"
+#include "maptrace.h"
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include <QSaveFile>
+#include <QTimer>
+#include <QEventLoop>
+#include <QThreadStorage>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+
+#define HTTP_CONCURRENCY 6      ///< 网络瓦片的默认并发连接数量
+#define HTTP_TIMEOUT     15000  ///< 网络瓦片请求超时(毫秒)
+
+/// 读取任务，开始执行后即不可取消
+class TileSource::FetchTask : public QRunnable
+{
+public:
+    FetchTask(TileSource *source, const GraphicsMap::TileSpec &tileSpec) :
+        m_source(source),
+        m_tileSpec(tileSpec)
+    {
+    }
+    void run() override
+    {
+        {
+            QMutexLocker locker(&m_source->m_mutex);
+            if(m_source->m_pendingTasks.value(m_tileSpec) == this)
+                m_source->m_pendingTasks.remove(m_tileSpec);
+        }
+        QElapsedTimer timer;
+        timer.start();
+        QByteArray data;
+        bool ok;
+        {
+            MAP_TRACE_SCOPE("tileRead");
+            ok = m_source->tryRead(m_tileSpec, data);
+        }
+        m_source->reportLatency(timer.nsecsElapsed() / 1000);
+        if(ok)
+            emit m_source->fetched(m_tileSpec, data);
+        else
+            emit m_source->failed(m_tileSpec);
+    }
+
+private:
+    TileSource           *m_source;
+    GraphicsMap::TileSpec m_tileSpec;
+};
+
+TileSource::TileSource(QObject *parent) : QObject(parent),
+    m_latency(0),
+    m_bTMS(0)
+{
+    // local disks are saturated with a few readers, decoding is the heavy part
+    m_ioPool.setMaxThreadCount(4);
+}
+
+TileSource::~TileSource()
+{
+    stop();
+}
+
+TileSource::Availability TileSource::availability(const GraphicsMap::TileSpec &tileSpec) const
+{
+    Q_UNUSED(tileSpec)
+    return Unknown;
+}
+
+int TileSource::maxZoom() const
+{
+    return -1;
+}
+
+void TileSource::fetch(const GraphicsMap::TileSpec &tileSpec, int priority)
+{
+    QMutexLocker locker(&m_mutex);
+    if(m_pendingTasks.contains(tileSpec))
+        return;
+    auto task = new FetchTask(this, tileSpec);
+    m_pendingTasks.insert(tileSpec, task);
+    m_ioPool.start(task, priority);
+}
+
+bool TileSource::cancel(const GraphicsMap::TileSpec &tileSpec)
+{
+    QMutexLocker locker(&m_mutex);
+    auto task = m_pendingTasks.value(tileSpec);
+    // the task has been started if it can't be taken out of the queue
+    if(!task || !m_ioPool.tryTake(task))
+        return false;
+    m_pendingTasks.remove(tileSpec);
+    delete task;
+    return true;
+}
+
+bool TileSource::tryRead(const GraphicsMap::TileSpec &tileSpec, QByteArray &data)
+{
+    data = read(tileSpec);
+    return true;
+}
+
+qint64 TileSource::latency() const
+{
+    return m_latency.loadAcquire();
+}
+
+void TileSource::setConcurrency(int count)
+{
+    m_ioPool.setMaxThreadCount(qMax(1, count));
+}
+
+void TileSource::setTMSMode(bool on)
+{
+    m_bTMS.storeRelease(on);
+}
+
+bool TileSource::isTMSMode() const
+{
+    return m_bTMS.loadAcquire();
+}
+
+TileSource *TileSource::create(const QString &path)
+{
+    if(path.startsWith("http://", Qt::CaseInsensitive) || path.startsWith("https://", Qt::CaseInsensitive))
+        return new HttpTileSource(path, HttpTileSource::defaultCacheDir(path));
+    if(QFileInfo(path).isFile())
+        return new ArchiveTileSource(path);
+    return new DirTileSource(path);
+}
+
+void TileSource::stop()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_ioPool.clear();
+        m_pendingTasks.clear();
+    }
+    m_ioPool.waitForDone();
+}
+
+/// 指数滑动平均，近期的读取耗时占1/8权重
+void TileSource::reportLatency(qint64 usec)
+{
+    auto latency = m_latency.loadAcquire();
+    m_latency.storeRelease(latency ? (latency * 7 + usec) / 8 : usec);
+}
+
+quint32 TileSource::fileY(const GraphicsMap::TileSpec &tileSpec) const
+{
+    quint32 tileCount = 1u << tileSpec.zoom;
+    return isTMSMode() ? tileCount - tileSpec.y - 1 : tileSpec.y;
+}
+
+DirTileSource::DirTileSource(const QString &path, QObject *parent) : TileSource(parent),
+    m_path(path),
+    m_indexCancel(0)
+{
+    m_indexPool.setMaxThreadCount(1);
+    m_indexPool.start(new FunctionTask([this](){
+        const auto fileName = TileIndex::indexFileName(m_path);
+        // the index saved before is used at once while it's checked against the directory
+        auto index = TileIndex::load(fileName);
+        if(index) {
+            setIndex(index);
+            if(index->isCurrent(m_path, &m_indexCancel) || m_indexCancel.loadAcquire())
+                return;
+        }
+        const bool stale = index;
+        index = TileIndex::scan(m_path, &m_indexCancel);
+        if(!index)
+            return;
+        // the tile directory may be read only, just ignore it
+        index->save(fileName);
+        setIndex(index);
+        if(stale)
+            emit changed();
+    }));
+}
+
+DirTileSource::~DirTileSource()
+{
+    m_indexCancel.storeRelease(1);
+    m_indexPool.waitForDone();
+    stop();
+}
+
+QString DirTileSource::name() const
+{
+    return m_path;
+}
+
+TileSource::Availability DirTileSource::availability(const GraphicsMap::TileSpec &tileSpec) const
+{
+    MAP_TRACE_SCOPE("tileExists");
+    auto tileIndex = index();
+    if(!tileIndex)
+        return Unknown;
+    return tileIndex->format(tileSpec.zoom, tileSpec.x, fileY(tileSpec)) == TileIndex::None ? Unavailable : Available;
+}
+
+int DirTileSource::maxZoom() const
+{
+    auto tileIndex = index();
+    return tileIndex ? tileIndex->maxZoom() : -1;
+}
+
+QByteArray DirTileSource::read(const GraphicsMap::TileSpec &tileSpec)
+{
+    QString fileName = QString("%1/%2/%3/%4")
+            .arg(m_path)
+            .arg(tileSpec.zoom)
+            .arg(tileSpec.x)
+            .arg(fileY(tileSpec));
+    // the index tells us the format, so there is no need to probe files
+    auto tileIndex = index();
+    if(tileIndex) {
+        auto format = tileIndex->format(tileSpec.zoom, tileSpec.x, fileY(tileSpec));
+        if(format == TileIndex::None)
+            return QByteArray();
+        fileName += format == TileIndex::Jpg ? ".jpg" : ".png";
+    }
+    else if(QFileInfo::exists(fileName+".jpg"))
+        fileName += ".jpg";
+    else if(QFileInfo::exists(fileName+".png"))
+        fileName += ".png";
+    else
+        return QByteArray();
+    //
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+    return file.readAll();
+}
+
+QSharedPointer<const TileIndex> DirTileSource::index() const
+{
+    QMutexLocker locker(&m_indexMutex);
+    return m_index;
+}
+
+void DirTileSource::setIndex(const QSharedPointer<const TileIndex> &index)
+{
+    QMutexLocker locker(&m_indexMutex);
+    m_index = index;
+}
+
+ArchiveTileSource::ArchiveTileSource(const QString &fileName, QObject *parent) : TileSource(parent),
+    m_fileName(fileName)
+{
+    m_archive.open(m_fileName);
+}
+
+ArchiveTileSource::~ArchiveTileSource()
+{
+    stop();
+}
+
+QString ArchiveTileSource::name() const
+{
+    return m_fileName;
+}
+
+TileSource::Availability ArchiveTileSource::availability(const GraphicsMap::TileSpec &tileSpec) const
+{
+    MAP_TRACE_SCOPE("tileExists");
+    return m_archive.contains(tileSpec.zoom, tileSpec.x, fileY(tileSpec)) ? Available : Unavailable;
+}
+
+int ArchiveTileSource::maxZoom() const
+{
+    return m_archive.maxZoom();
+}
+
+/// \note 数据复制出映射内存：排队中的fetched信号、解码任务和缓存都可能比数据源存在得更久(比如被同名数据源替换)
+QByteArray ArchiveTileSource::read(const GraphicsMap::TileSpec &tileSpec)
+{
+    const auto data = m_archive.tile(tileSpec.zoom, tileSpec.x, fileY(tileSpec));
+    return QByteArray(data.constData(), data.size());
+}
+
+/// 每个I/O线程一个连接管理器，线程内先后的请求复用同一连接，线程退出时释放
+static QNetworkAccessManager *threadNetworkManager()
+{
+    static QThreadStorage<QNetworkAccessManager*> managers;
+    if(!managers.hasLocalData())
+        managers.setLocalData(new QNetworkAccessManager);
+    return managers.localData();
+}
+
+HttpTileSource::HttpTileSource(const QString &urlTemplate, const QString &cacheDir, QObject *parent) : TileSource(parent),
+    m_urlTemplate(urlTemplate),
+    m_cacheDir(cacheDir),
+    m_timeout(HTTP_TIMEOUT)
+{
+    // each I/O thread keeps one connection, so this bounds the connections to the server
+    setConcurrency(HTTP_CONCURRENCY);
+    m_writePool.setMaxThreadCount(1);
+}
+
+HttpTileSource::~HttpTileSource()
+{
+    stop();
+    m_writePool.waitForDone();
+}
+
+QString HttpTileSource::name() const
+{
+    return m_urlTemplate;
+}
+
+QByteArray HttpTileSource::read(const GraphicsMap::TileSpec &tileSpec)
+{
+    QByteArray data;
+    tryRead(tileSpec, data);
+    return data;
+}
+
+/// \details 先读磁盘缓存，未命中时请求服务器，取得的瓦片在后台写入磁盘缓存
+bool HttpTileSource::tryRead(const GraphicsMap::TileSpec &tileSpec, QByteArray &data)
+{
+    data = readCache(tileSpec);
+    if(!data.isEmpty())
+        return true;
+    if(!download(tileSpec, data))
+        return false;
+    if(!data.isEmpty())
+        writeCache(tileSpec, data);
+    return true;
+}
+
+QString HttpTileSource::cacheDir() const
+{
+    return m_cacheDir;
+}
+
+void HttpTileSource::setTimeout(int msec)
+{
+    m_timeout.storeRelease(qMax(1, msec));
+}
+
+QString HttpTileSource::defaultCacheDir(const QString &urlTemplate)
+{
+    const auto digest = QCryptographicHash::hash(urlTemplate.toUtf8(), QCryptographicHash::Md5).toHex().left(16);
+    return QString("%1/tiles/%2")
+            .arg(QStandardPaths::writableLocation(QStandardPaths::CacheLocation))
+            .arg(QString::fromLatin1(digest));
+}
+
+QUrl HttpTileSource::tileUrl(const GraphicsMap::TileSpec &tileSpec) const
+{
+    QString url = m_urlTemplate;
+    url.replace("{z}", QString::number(tileSpec.zoom))
+            .replace("{x}", QString::number(tileSpec.x))
+            .replace("{y}", QString::number(fileY(tileSpec)));
+    return QUrl(url);
+}
+
+/// 与DirTileSource相同的目录结构，不含扩展名
+QString HttpTileSource::cacheFile(const GraphicsMap::TileSpec &tileSpec) const
+{
+    return QString("%1/%2/%3/%4")
+            .arg(m_cacheDir)
+            .arg(tileSpec.zoom)
+            .arg(tileSpec.x)
+            .arg(fileY(tileSpec));
+}
+
+QByteArray HttpTileSource::readCache(const GraphicsMap::TileSpec &tileSpec) const
+{
+    if(m_cacheDir.isEmpty())
+        return QByteArray();
+    const auto fileName = cacheFile(tileSpec);
+    // a failed open costs no more than probing for the file
+    for(auto suffix : {".jpg", ".png"}) {
+        QFile file(fileName + suffix);
+        if(file.open(QIODevice::ReadOnly))
+            return file.readAll();
+    }
+    return QByteArray();
+}
+
+/// \note 只缓存jpg和png瓦片，其他格式无法按瓦片目录读取
+void HttpTileSource::writeCache(const GraphicsMap::TileSpec &tileSpec, const QByteArray &data)
+{
+    if(m_cacheDir.isEmpty())
+        return;
+    const char *suffix = data.startsWith("\xFF\xD8") ? ".jpg" : data.startsWith("\x89PNG") ? ".png" : nullptr;
+    if(!suffix)
+        return;
+    m_writePool.start(new FunctionTask([this, tileSpec, data, suffix](){
+        const auto fileName = cacheFile(tileSpec) + suffix;
+        QDir().mkpath(QFileInfo(fileName).path());
+        // readers never see a partially written tile
+        QSaveFile file(fileName);
+        if(file.open(QIODevice::WriteOnly) && file.write(data) == data.size())
+            file.commit();
+    }));
+}
+
+/// \details 在I/O线程中同步等待请求完成，超时中断请求。404和410代表瓦片不存在，返回成功和空数据
+bool HttpTileSource::download(const GraphicsMap::TileSpec &tileSpec, QByteArray &data) const
+{
+    data.clear();
+    QNetworkRequest request(tileUrl(tileSpec));
+    request.setAttribute(QNetworkRequest::FollowRedirectsAttribute, true);
+    request.setRawHeader("Connection", "keep-alive");
+    QScopedPointer<QNetworkReply> reply(threadNetworkManager()->get(request));
+    QEventLoop loop;
+    QTimer timer;
+    timer.setSingleShot(true);
+    QObject::connect(reply.data(), &QNetworkReply::finished, &loop, &QEventLoop::quit);
+    QObject::connect(&timer, &QTimer::timeout, reply.data(), &QNetworkReply::abort);
+    timer.start(m_timeout.loadAcquire());
+    loop.exec();
+    const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if(status == 404 || status == 410)
+        return true;
+    // network errors, timeouts and server errors say nothing about the tile
+    if(reply->error() != QNetworkReply::NoError)
+        return false;
+    data = reply->readAll();
+    return true;
+}
@@ -0,0 +1,195 @@
+﻿#ifndef TILESOURCE_H
+#define TILESOURCE_H
+
+#include "graphicsmap.h"
+#include "tilearchive.h"
+#include <QObject>
+#include <QThreadPool>
+#include <QMutex>
+#include <QHash>
+#include <QRunnable>
+#include <QUrl>
+#include <functional>
+
+class TileIndex;
+
+/// 执行任意函数的线程池任务(Qt5.15之前没有QRunnable::create)
+class FunctionTask : public QRunnable
+{
+public:
+    explicit FunctionTask(std::function<void()> function) :
+        m_function(std::move(function))
+    {
+    }
+    void run() override
+    {
+        m_function();
+    }
+
+private:
+    std::function<void()> m_function;
+};
+
+/*!
+ * \brief 瓦片数据源
+ * \details 为瓦片线程提供瓦片的原始编码数据(jpg/png)，解码统一由瓦片线程的解码线程池负责，从而让不同数据源的I/O和解码相互重叠。
+ * 默认实现在数据源自己的I/O线程池中调用read()完成异步读取，派生类也可以重写fetch()和cancel()实现真正的异步读取(比如网络请求)
+ * \note 1.fetched信号可能在任意线程发出
+ * 2.派生类析构时必须先调用stop()，以免I/O线程访问已析构的派生类
+ */
+class GRAPHICSMAPLIB_EXPORT TileSource : public QObject
+{
+    Q_OBJECT
+public:
+    /// 瓦片可用性
+    enum Availability {
+        Unknown,        ///< 需要实际读取才能确定
+        Available,      ///< 瓦片存在
+        Unavailable     ///< 瓦片不存在，无需读取
+    };
+
+    TileSource(QObject *parent = nullptr);
+    ~TileSource();
+    /// 数据源唯一名称，地图通过名称区分瓦片类型
+    virtual QString name() const = 0;
+    /// 查询瓦片可用性
+    virtual Availability availability(const GraphicsMap::TileSpec &tileSpec) const;
+    /// 包含瓦片的最大层级，-1代表未知
+    virtual int maxZoom() const;
+    /// 异步读取瓦片，完成后发出fetched信号 \param priority 优先级，越大越先读取
+    virtual void fetch(const GraphicsMap::TileSpec &tileSpec, int priority = 0);
+    /// 取消尚未开始的读取 \return 是否取消成功，已经开始的读取无法取消，仍会发出fetched信号
+    virtual bool cancel(const GraphicsMap::TileSpec &tileSpec);
+    /// 同步读取瓦片数据，瓦片不存在时返回空 \note 会在I/O线程池中被并发调用
+    virtual QByteArray read(const GraphicsMap::TileSpec &tileSpec) = 0;
+    /// 同步读取瓦片数据，区分读取失败和瓦片不存在 \return 是否读取成功，失败(比如网络错误、超时)时稍后可以重试
+    /// \note 默认实现调用read()，总是成功
+    virtual bool tryRead(const GraphicsMap::TileSpec &tileSpec, QByteArray &data);
+    /// 平均读取耗时(微秒)，由数据源统计
+    qint64 latency() const;
+    /// 设置I/O并发数量
+    void setConcurrency(int count);
+    /// 设置TMS瓦片协议 默认XYZ协议
+    void setTMSMode(bool on);
+    bool isTMSMode() const;
+
+public:
+    /// 通过瓦片路径创建数据源：http(s)地址为网络瓦片服务，文件为单文件瓦片包，否则为瓦片目录
+    static TileSource *create(const QString &path);
+
+signals:
+    /// 瓦片读取完成，data为空代表瓦片不存在
+    void fetched(const GraphicsMap::TileSpec &tileSpec, const QByteArray &data);
+    /// 瓦片读取失败，瓦片可能存在，稍后可以重新读取
+    void failed(const GraphicsMap::TileSpec &tileSpec);
+    /// 数据源内容发生变化，之前读取的瓦片和可用性可能已经过时
+    void changed();
+
+protected:
+    /// 停止I/O线程池中的所有读取任务
+    void stop();
+    /// 记录一次读取耗时(微秒)
+    void reportLatency(qint64 usec);
+    /// 瓦片文件的y编号(TMS模式下翻转)
+    quint32 fileY(const GraphicsMap::TileSpec &tileSpec) const;
+
+private:
+    class FetchTask;
+    QThreadPool m_ioPool;       ///< I/O线程池
+    QMutex      m_mutex;        ///< 保护m_pendingTasks
+    QHash<GraphicsMap::TileSpec, FetchTask*> m_pendingTasks;   ///< 尚未开始的读取任务
+    QAtomicInteger<qint64> m_latency;   ///< 平均读取耗时
+    QAtomicInt             m_bTMS;
+};
+
+/*!
+ * \brief 瓦片目录数据源
+ * \details 读取path/z/x/y.jpg|png格式的瓦片目录。后台读取或建立瓦片可用性索引(瓦片目录下的tiles.idx)，索引就绪后缺失瓦片不再访问磁盘。
+ * 读取到的索引文件先行使用，同时在后台核对瓦片目录，目录内容已变化时重新建立索引并发出changed信号
+ */
+class GRAPHICSMAPLIB_EXPORT DirTileSource : public TileSource
+{
+    Q_OBJECT
+public:
+    DirTileSource(const QString &path, QObject *parent = nullptr);
+    ~DirTileSource();
+    QString name() const override;
+    Availability availability(const GraphicsMap::TileSpec &tileSpec) const override;
+    int maxZoom() const override;
+    QByteArray read(const GraphicsMap::TileSpec &tileSpec) override;
+
+private:
+    QSharedPointer<const TileIndex> index() const;
+    void setIndex(const QSharedPointer<const TileIndex> &index);
+
+private:
+    QString        m_path;
+    mutable QMutex m_indexMutex;    ///< 保护m_index
+    QSharedPointer<const TileIndex> m_index;   ///< 瓦片可用性索引，为空代表尚未就绪
+    QAtomicInt     m_indexCancel;   ///< 中断正在建立的索引
+    QThreadPool    m_indexPool;     ///< 索引建立线程
+};
+
+/*!
+ * \brief 单文件瓦片包数据源
+ * \details 读取TileArchive格式的瓦片包，瓦片数据从映射内存复制，读取不经过文件系统调用
+ */
+class GRAPHICSMAPLIB_EXPORT ArchiveTileSource : public TileSource
+{
+    Q_OBJECT
+public:
+    ArchiveTileSource(const QString &fileName, QObject *parent = nullptr);
+    ~ArchiveTileSource();
+    QString name() const override;
+    Availability availability(const GraphicsMap::TileSpec &tileSpec) const override;
+    int maxZoom() const override;
+    QByteArray read(const GraphicsMap::TileSpec &tileSpec) override;
+
+private:
+    QString     m_fileName;
+    TileArchive m_archive;
+};
+
+/*!
+ * \brief 网络瓦片数据源
+ * \details 按XYZ/WMTS风格的URL模板请求瓦片，模板中的{z}、{x}、{y}替换为瓦片编号(TMS模式下y翻转)，
+ * 比如http://localhost:8080/tiles/{z}/{x}/{y}.png。
+ * 每个I/O线程使用自己的连接管理器同步请求，连接保持复用(HTTP keep-alive)，同时打开的连接数量即I/O并发数量(参见setConcurrency())。
+ * 设置了缓存目录时，请求的瓦片在后台按path/z/x/y.jpg|png的目录结构写入磁盘，之后的读取直接命中磁盘缓存，
+ * 缓存目录也可以直接作为瓦片目录离线使用
+ * \note 只有404和410视为瓦片不存在，其他错误、5xx和超时视为读取失败(参见tryRead())，都不写入缓存
+ */
+class GRAPHICSMAPLIB_EXPORT HttpTileSource : public TileSource
+{
+    Q_OBJECT
+public:
+    /// \param cacheDir 磁盘缓存目录，为空时不缓存
+    HttpTileSource(const QString &urlTemplate, const QString &cacheDir = QString(), QObject *parent = nullptr);
+    ~HttpTileSource();
+    QString name() const override;
+    QByteArray read(const GraphicsMap::TileSpec &tileSpec) override;
+    bool tryRead(const GraphicsMap::TileSpec &tileSpec, QByteArray &data) override;
+    /// 磁盘缓存目录
+    QString cacheDir() const;
+    /// 设置请求超时(毫秒) 默认15秒
+    void setTimeout(int msec);
+
+public:
+    /// 缺省的磁盘缓存目录：系统缓存目录下按URL模板区分的子目录
+    static QString defaultCacheDir(const QString &urlTemplate);
+
+private:
+    QUrl tileUrl(const GraphicsMap::TileSpec &tileSpec) const;
+    QString cacheFile(const GraphicsMap::TileSpec &tileSpec) const;
+    QByteArray readCache(const GraphicsMap::TileSpec &tileSpec) const;
+    void writeCache(const GraphicsMap::TileSpec &tileSpec, const QByteArray &data);
+    bool download(const GraphicsMap::TileSpec &tileSpec, QByteArray &data) const;
+
+private:
+    QString     m_urlTemplate;
+    QString     m_cacheDir;
+    QAtomicInt  m_timeout;      ///< 请求超时(毫秒)
+    QThreadPool m_writePool;    ///< 磁盘缓存写入线程
+};
+
+#endif // TILESOURCE_H
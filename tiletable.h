@@ -0,0 +1,214 @@
+﻿#ifndef TILETABLE_H
+#define TILETABLE_H
+
+#include <QtGlobal>
+#include <QVector>
+#include <utility>
+
+/// x、y各取低24位交错为48位Morton编码(x在偶数位，y在奇数位)
+/// \see https://graphics.stanford.edu/~seander/bithacks.html#InterleaveBMN
+inline quint64 tileMorton(quint32 x, quint32 y)
+{
+    auto spread = [](quint64 v) {
+        v &= 0xFFFFFF;
+        v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+        v = (v | (v << 8))  & 0x00FF00FF00FF00FFull;
+        v = (v | (v << 4))  & 0x0F0F0F0F0F0F0F0Full;
+        v = (v | (v << 2))  & 0x3333333333333333ull;
+        v = (v | (v << 1))  & 0x5555555555555555ull;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+/*!
+ * \brief 以Morton编码为键的开放寻址瓦片表
+ * \details 键的高8位为瓦片类型，48~52位为层级，低48位为x、y交错的Morton编码(参见key())，
+ * 上一层瓦片的键只需层级减一、Morton编码右移两位(参见parentKey())。
+ * 键、值和访问标记分别连续存放，线性探测，删除时后移补位不留墓碑，查找通常只访问一两条缓存行。
+ * 每次查找都会设置槽位的访问标记，evictCandidate()按CLOCK算法给出淘汰候选
+ * \note 非线程安全；插入和删除会移动元素，find()返回的指针只在下一次插入或删除前有效
+ */
+template <typename T>
+class TileTable
+{
+public:
+    static constexpr quint64 EmptyKey = ~quint64(0);    ///< 空槽位，合法的键最高3位之外不会全为1
+    static constexpr quint64 MortonMask = (quint64(1) << 48) - 1;
+
+    /// 瓦片的键
+    static inline quint64 key(quint8 type, quint8 zoom, quint32 x, quint32 y) {
+        return (quint64(type) << 56) | (quint64(zoom & 0x1F) << 48) | tileMorton(x, y);
+    }
+    /// 上一层瓦片的键 \note 层级必须大于0
+    static inline quint64 parentKey(quint64 key) {
+        return ((key & ~MortonMask) - (quint64(1) << 48)) | ((key & MortonMask) >> 2);
+    }
+
+    TileTable() : m_size(0), m_hand(0) {}
+
+    inline int size() const { return m_size; }
+    inline bool isEmpty() const { return m_size == 0; }
+    inline bool contains(quint64 key) const { return slot(key) >= 0; }
+
+    /// 查找并设置访问标记，不存在返回nullptr
+    T *find(quint64 key) {
+        auto i = slot(key);
+        if(i < 0)
+            return nullptr;
+        m_referenced[i] = 1;
+        return &m_values[i];
+    }
+    /// 查找，不存在时插入默认值
+    T &operator[](quint64 key) {
+        auto i = slot(key);
+        if(i < 0)
+            i = insertSlot(key, T());
+        m_referenced[i] = 1;
+        return m_values[i];
+    }
+    /// 插入或替换
+    void insert(quint64 key, const T &value) {
+        auto i = slot(key);
+        if(i < 0)
+            i = insertSlot(key, value);
+        else
+            m_values[i] = value;
+        m_referenced[i] = 1;
+    }
+    /// 取出并删除，不存在返回默认值
+    T take(quint64 key) {
+        auto i = slot(key);
+        if(i < 0)
+            return T();
+        T value = std::move(m_values[i]);
+        eraseSlot(i);
+        return value;
+    }
+    bool remove(quint64 key) {
+        auto i = slot(key);
+        if(i < 0)
+            return false;
+        eraseSlot(i);
+        return true;
+    }
+    void clear() {
+        m_keys.clear();
+        m_values.clear();
+        m_referenced.clear();
+        m_size = 0;
+        m_hand = 0;
+    }
+    /// 遍历所有元素 \param func void(quint64 key, T &value)，遍历过程中不能插入或删除
+    template <typename Func>
+    void forEach(Func func) {
+        for(int i = 0; i < m_keys.size(); ++i) {
+            if(m_keys[i] != EmptyKey)
+                func(m_keys[i], m_values[i]);
+        }
+    }
+    /// CLOCK算法：表针扫过有访问标记的槽位时清除标记，停在第一个没有标记的槽位 \return 淘汰候选的键，表为空时返回EmptyKey
+    quint64 evictCandidate() {
+        if(m_size == 0)
+            return EmptyKey;
+        const int mask = m_keys.size() - 1;
+        forever {
+            m_hand = (m_hand + 1) & mask;
+            if(m_keys[m_hand] == EmptyKey)
+                continue;
+            if(m_referenced[m_hand]) {
+                m_referenced[m_hand] = 0;
+                continue;
+            }
+            return m_keys[m_hand];
+        }
+    }
+
+private:
+    /// 键中的层级和类型集中在高位，乘法散列把它们混入取用的高位
+    inline int home(quint64 key) const {
+        return int((key * 0x9E3779B97F4A7C15ull) >> m_shift) & (m_keys.size() - 1);
+    }
+    int slot(quint64 key) const {
+        if(m_keys.isEmpty())
+            return -1;
+        const int mask = m_keys.size() - 1;
+        for(int i = home(key); ; i = (i + 1) & mask) {
+            if(m_keys[i] == key)
+                return i;
+            if(m_keys[i] == EmptyKey)
+                return -1;
+        }
+    }
+    int insertSlot(quint64 key, const T &value) {
+        // keep the load factor under 3/4
+        if((m_size + 1) * 4 > m_keys.size() * 3)
+            rehash(qMax(64, m_keys.size() * 2));
+        const int mask = m_keys.size() - 1;
+        int i = home(key);
+        while(m_keys[i] != EmptyKey) {
+            i = (i + 1) & mask;
+        }
+        m_keys[i] = key;
+        m_values[i] = value;
+        ++m_size;
+        return i;
+    }
+    /// 后移补位：把探测链上后面的元素移到空出的槽位，保证查找遇到空槽即可结束
+    void eraseSlot(int i) {
+        const int mask = m_keys.size() - 1;
+        int j = i;
+        forever {
+            j = (j + 1) & mask;
+            if(m_keys[j] == EmptyKey)
+                break;
+            // the element at j stays if its home slot lies cyclically in (i, j]
+            const int k = home(m_keys[j]);
+            if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                continue;
+            m_keys[i] = m_keys[j];
+            m_values[i] = std::move(m_values[j]);
+            m_referenced[i] = m_referenced[j];
+            i = j;
+        }
+        m_keys[i] = EmptyKey;
+        m_values[i] = T();
+        m_referenced[i] = 0;
+        --m_size;
+    }
+    void rehash(int capacity) {
+        QVector<quint64> keys(capacity, EmptyKey);
+        QVector<T> values(capacity);
+        QVector<quint8> referenced(capacity, 0);
+        qSwap(keys, m_keys);
+        qSwap(values, m_values);
+        qSwap(referenced, m_referenced);
+        m_shift = 64;
+        for(int n = capacity; n > 1; n >>= 1) {
+            --m_shift;
+        }
+        m_size = 0;
+        m_hand = 0;
+        for(int i = 0; i < keys.size(); ++i) {
+            if(keys[i] == EmptyKey)
+                continue;
+            auto j = insertSlot(keys[i], values[i]);
+            m_referenced[j] = referenced[i];
+        }
+    }
+
+private:
+    QVector<quint64> m_keys;        ///< 键，EmptyKey代表空槽位
+    QVector<T>       m_values;      ///< 值
+    QVector<quint8>  m_referenced;  ///< CLOCK访问标记
+    int              m_size;        ///< 元素数量
+    int              m_hand;        ///< CLOCK表针
+    int              m_shift = 64;  ///< 散列取高位时的右移位数
+};
+
+template <typename T>
+constexpr quint64 TileTable<T>::EmptyKey;
+template <typename T>
+constexpr quint64 TileTable<T>::MortonMask;
+
+#endif // TILETABLE_H
@@ -0,0 +1,38 @@
+﻿#include "tilearchive.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QDebug>
+
+/// 将瓦片目录打包为单文件瓦片包，用法：TilePacker E:/map/sate E:/map/sate.gmta
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("TilePacker");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Pack a tile directory (path/z/x/y.jpg|png) into a single tile archive.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("source", "Tile directory to pack.");
+    parser.addPositionalArgument("archive", "Output archive file.");
+    parser.process(app);
+
+    const auto args = parser.positionalArguments();
+    if(args.size() != 2)
+        parser.showHelp(1);
+
+    QElapsedTimer timer;
+    timer.start();
+    QString error;
+    if(!TileArchive::pack(args.at(0), args.at(1), &error)) {
+        qCritical().noquote() << error;
+        return 1;
+    }
+    TileArchive archive;
+    if(!archive.open(args.at(1))) {
+        qCritical().noquote() << "packed archive can not be opened:" << args.at(1);
+        return 1;
+    }
+    qInfo().noquote() << QString("%1 tiles packed in %2 ms").arg(archive.count()).arg(timer.elapsed());
+    return 0;
+}
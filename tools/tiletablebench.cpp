@@ -0,0 +1,178 @@
+﻿#include "graphicsmap.h"
+#include "tiletable.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QCache>
+#include <QSet>
+#include <QVector>
+#include <QDebug>
+
+namespace {
+
+/// 改用TileTable之前的瓦片编号，比较、相等和散列与当时的GraphicsMap::TileSpec相同
+struct LegacySpec {
+    quint8 type;
+    quint8 zoom;
+    quint32 x;
+    quint32 y;
+    inline LegacySpec rise() const {
+        return LegacySpec({type, static_cast<quint8>(zoom-1), x/2, y/2});
+    }
+    inline bool operator== (const LegacySpec &rhs) const {
+        return this->toLong() == rhs.toLong();
+    }
+    inline qlonglong toLong() const {
+        return (qlonglong(type)<<52) | (qlonglong(zoom)<< 44) | (qlonglong(x)<< 22) | y;
+    }
+};
+
+inline uint qHash(const LegacySpec &key, uint seed)
+{
+    qlonglong keyVal = (qlonglong(key.zoom)<<48) + (qlonglong(key.x)<< 24) + key.y;
+    return qHash(keyVal, seed);
+}
+
+/// 视口大小的瓦片区域逐层向上的所有瓦片，与视图瓦片的引用表内容相近
+QVector<GraphicsMap::TileSpec> viewTiles(quint8 zoom, int count)
+{
+    QVector<GraphicsMap::TileSpec> specs;
+    const quint32 origin = (1u << zoom) / 3;
+    for(quint32 y = 0; y < quint32(count); ++y) {
+        for(quint32 x = 0; x < quint32(count); ++x) {
+            GraphicsMap::TileSpec spec{1, zoom, origin + x, origin + y};
+            specs.append(spec);
+            while(spec.zoom > 0) {
+                spec = spec.rise();
+                specs.append(spec);
+            }
+        }
+    }
+    return specs;
+}
+
+inline LegacySpec legacy(const GraphicsMap::TileSpec &spec)
+{
+    return LegacySpec{spec.type, spec.zoom, spec.x, spec.y};
+}
+
+/// 耗时(纳秒/次)
+double nsPerOp(const QElapsedTimer &timer, qint64 ops)
+{
+    return double(timer.nsecsElapsed()) / qMax<qint64>(1, ops);
+}
+
+}
+
+/// 瓦片表微基准：与改用TileTable之前的容器比较。
+/// 缓存查找为QCache<TileSpec>::object与TileTable::find，引用查找为QSet<TileSpec>::contains与TileTable::contains，
+/// 逐层向上为rise()加QSet查找与parentKey加TileTable查找。旧容器使用当时的qHash(TileSpec)，新容器的键在计时内计算。
+/// 用法：TileTableBench -r 200
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("TileTableBench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Compare TileTable with the QCache and QSet of TileSpec it replaced.");
+    parser.addHelpOption();
+    QCommandLineOption zoomOption({"z", "zoom"}, "Zoom of the view tiles.", "zoom", "18");
+    QCommandLineOption countOption({"n", "count"}, "View tiles per row and column.", "count", "16");
+    QCommandLineOption roundOption({"r", "rounds"}, "Rounds of each measurement.", "rounds", "100");
+    parser.addOptions({zoomOption, countOption, roundOption});
+    parser.process(app);
+
+    const auto zoom = quint8(qBound(1, parser.value(zoomOption).toInt(), 24));
+    const auto count = qBound(1, parser.value(countOption).toInt(), 255);
+    const auto rounds = qMax(1, parser.value(roundOption).toInt());
+
+    const auto specs = viewTiles(zoom, count);
+    QVector<LegacySpec> legacySpecs;
+    legacySpecs.reserve(specs.size());
+    for(const auto &spec : specs) {
+        legacySpecs.append(legacy(spec));
+    }
+    QCache<LegacySpec, int> cache(specs.size());
+    QSet<LegacySpec> set;
+    TileTable<int> table;
+    for(int i = 0; i < specs.size(); ++i) {
+        cache.insert(legacySpecs.at(i), new int(i));
+        set.insert(legacySpecs.at(i));
+        table.insert(specs.at(i).toKey(), i);
+    }
+    const qint64 lookups = qint64(specs.size()) * rounds;
+    // the sums keep the loops from being optimized away
+    quint64 sum = 0;
+
+    QElapsedTimer timer;
+    timer.start();
+    for(int r = 0; r < rounds; ++r) {
+        for(const auto &spec : legacySpecs) {
+            sum += quint64(*cache.object(spec));
+        }
+    }
+    const auto cacheTime = nsPerOp(timer, lookups);
+
+    timer.restart();
+    for(int r = 0; r < rounds; ++r) {
+        for(const auto &spec : specs) {
+            sum += quint64(*table.find(spec.toKey()));
+        }
+    }
+    const auto tableFindTime = nsPerOp(timer, lookups);
+
+    timer.restart();
+    for(int r = 0; r < rounds; ++r) {
+        for(const auto &spec : legacySpecs) {
+            sum += set.contains(spec);
+        }
+    }
+    const auto setTime = nsPerOp(timer, lookups);
+
+    timer.restart();
+    for(int r = 0; r < rounds; ++r) {
+        for(const auto &spec : specs) {
+            sum += table.contains(spec.toKey());
+        }
+    }
+    const auto tableContainsTime = nsPerOp(timer, lookups);
+
+    // walk from each view tile up to zoom 0, as addViewTile does when nothing is cached
+    const auto viewCount = quint32(count * count);
+    const quint32 origin = (1u << zoom) / 3;
+    qint64 steps = 0;
+    timer.restart();
+    for(int r = 0; r < rounds; ++r) {
+        for(quint32 i = 0; i < viewCount; ++i) {
+            LegacySpec spec{1, zoom, origin + i % quint32(count), origin + i / quint32(count)};
+            while(spec.zoom > 0) {
+                spec = spec.rise();
+                sum += set.contains(spec);
+                ++steps;
+            }
+        }
+    }
+    const auto riseTime = nsPerOp(timer, steps);
+
+    steps = 0;
+    timer.restart();
+    for(int r = 0; r < rounds; ++r) {
+        for(quint32 i = 0; i < viewCount; ++i) {
+            GraphicsMap::TileSpec spec{1, zoom, origin + i % quint32(count), origin + i / quint32(count)};
+            auto key = spec.toKey();
+            while(spec.zoom > 0) {
+                spec = spec.rise();
+                key = TileTable<int>::parentKey(key);
+                sum += table.contains(key);
+                ++steps;
+            }
+        }
+    }
+    const auto parentTime = nsPerOp(timer, steps);
+
+    qInfo().noquote() << QString("%1 tiles, %2 rounds (checksum %3)").arg(specs.size()).arg(rounds).arg(sum);
+    qInfo().noquote() << QString("cache lookup  TileTable::find %1 ns  QCache::object %2 ns").arg(tableFindTime, 0, 'f', 2).arg(cacheTime, 0, 'f', 2);
+    qInfo().noquote() << QString("ref lookup    TileTable::contains %1 ns  QSet::contains %2 ns").arg(tableContainsTime, 0, 'f', 2).arg(setTime, 0, 'f', 2);
+    qInfo().noquote() << QString("walk up       parentKey %1 ns  rise() + QSet %2 ns").arg(parentTime, 0, 'f', 2).arg(riseTime, 0, 'f', 2);
+    return 0;
+}